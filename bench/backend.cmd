@@ -0,0 +1,23 @@
+# Compare the queue backends on traversal-bound operations; run it against
+# builds with BACKEND=list, unrolled and ring. Shuffling first scatters the
+# nodes over the heap, as a long-lived queue would have them.
+option fail 0
+option malloc 0
+option timeout 120
+option verbose 1
+new
+ih RAND 1000000
+shuffle
+time reverse
+time dm
+time sort
+shuffle
+time sort
+free
+new
+ih RAND 4000000
+shuffle
+time reverse
+time dm
+time sort
+free
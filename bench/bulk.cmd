@@ -0,0 +1,11 @@
+# Time repeated insertions and removals, which go through the bulk functions
+# in batches; compare with the same counts spelled out one command at a time.
+option fail 0
+option malloc 0
+option timeout 120
+option verbose 1
+new
+time it dolphin 1000000
+time ih RAND 1000000
+time rh RAND 2000000
+free
@@ -0,0 +1,20 @@
+# Time a queue of interned strings, one test_malloc() block per distinct
+# string, with the harness keeping a header and footer around every block and
+# then with only a canary inline. Compare the peak resident set size of the two
+# runs by splitting this file at "option compact 1".
+option fail 0
+option malloc 0
+option timeout 120
+option verbose 1
+option intern 1
+new
+time ih RAND 1000000
+time sort
+time shuffle
+time free
+option compact 1
+new
+time ih RAND 1000000
+time sort
+time shuffle
+time free
@@ -0,0 +1,9 @@
+# Benchmark the lock-free queue against a mutex-wrapped queue with 1 to 16
+# producer/consumer pairs
+option fail 0
+option malloc 0
+lfqbench 1 400000
+lfqbench 2 200000
+lfqbench 4 100000
+lfqbench 8 50000
+lfqbench 16 25000
@@ -0,0 +1,11 @@
+# A hundred sorted queues of 10k random strings, sourced by bench/merge.cmd
+source bench/merge-10q.cmd
+source bench/merge-10q.cmd
+source bench/merge-10q.cmd
+source bench/merge-10q.cmd
+source bench/merge-10q.cmd
+source bench/merge-10q.cmd
+source bench/merge-10q.cmd
+source bench/merge-10q.cmd
+source bench/merge-10q.cmd
+source bench/merge-10q.cmd
@@ -0,0 +1,31 @@
+# Ten sorted queues of 10k random strings, sourced by bench/merge.cmd
+new
+ih RAND 10000
+sort
+new
+ih RAND 10000
+sort
+new
+ih RAND 10000
+sort
+new
+ih RAND 10000
+sort
+new
+ih RAND 10000
+sort
+new
+ih RAND 10000
+sort
+new
+ih RAND 10000
+sort
+new
+ih RAND 10000
+sort
+new
+ih RAND 10000
+sort
+new
+ih RAND 10000
+sort
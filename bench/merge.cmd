@@ -0,0 +1,17 @@
+# Benchmark q_merge on 1000 sorted queues of 10k random strings each
+option fail 0
+option malloc 0
+option timeout 120
+option verbose 1
+source bench/merge-100q.cmd
+source bench/merge-100q.cmd
+source bench/merge-100q.cmd
+source bench/merge-100q.cmd
+source bench/merge-100q.cmd
+source bench/merge-100q.cmd
+source bench/merge-100q.cmd
+source bench/merge-100q.cmd
+source bench/merge-100q.cmd
+source bench/merge-100q.cmd
+time merge
+free
@@ -0,0 +1,26 @@
+# Benchmark q_sort on presorted input: random, sorted, reversed and sorted
+# with adjacent pairs swapped, for the bottom-up (0) and adaptive (2) engines.
+option fail 0
+option malloc 0
+option timeout 120
+option verbose 1
+new
+ih RAND 1000000
+option sorter 0
+time sort
+time sort
+reverse
+time sort
+swap
+time sort
+free
+new
+ih RAND 1000000
+option sorter 2
+time sort
+time sort
+reverse
+time sort
+swap
+time sort
+free
@@ -0,0 +1,27 @@
+# Benchmark the radix sort (3) against the merge sorts (0, 2) on the
+# trace-15-perf workload scaled to 10M random strings.
+option fail 0
+option malloc 0
+option timeout 120
+option verbose 1
+option sorter 0
+new
+ih RAND 10000000
+time sort
+reverse
+time sort
+free
+option sorter 2
+new
+ih RAND 10000000
+time sort
+reverse
+time sort
+free
+option sorter 3
+new
+ih RAND 10000000
+time sort
+reverse
+time sort
+free
@@ -0,0 +1,11 @@
+# Benchmark shuffle on 1M random strings, then check it for uniformity
+option fail 0
+option malloc 0
+option timeout 120
+option verbose 1
+new
+ih RAND 1000000
+time shuffle
+time shuffle
+free
+shufflecheck
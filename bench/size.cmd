@@ -0,0 +1,11 @@
+# Benchmark q_size, which reads the length kept by the queue header
+option fail 0
+option malloc 0
+option timeout 120
+option verbose 1
+new
+ih RAND 1000000
+time size 1000000
+dedup
+time size 1000000
+free
@@ -0,0 +1,49 @@
+# Benchmark q_sort engines on random strings
+# 'option sorter 0' selects the bottom-up merge sort and
+# 'option sorter 1' the recursive top-down merge sort it replaced.
+option fail 0
+option malloc 0
+option timeout 120
+option verbose 1
+new
+ih RAND 100000
+option sorter 1
+time sort
+reverse
+time sort
+free
+new
+ih RAND 100000
+option sorter 0
+time sort
+reverse
+time sort
+free
+new
+ih RAND 1000000
+option sorter 1
+time sort
+reverse
+time sort
+free
+new
+ih RAND 1000000
+option sorter 0
+time sort
+reverse
+time sort
+free
+new
+ih RAND 10000000
+option sorter 1
+time sort
+reverse
+time sort
+free
+new
+ih RAND 10000000
+option sorter 0
+time sort
+reverse
+time sort
+free
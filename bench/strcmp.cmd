@@ -0,0 +1,14 @@
+# Compare simd_strcmp() implementations with the C library's strcmp() on
+# random strings like those of "ih RAND" and on equal-prefix pairs of growing
+# length. The queue compares 8-byte keys first, so only strings that share
+# their first 8 bytes reach the string comparison, and only past that point.
+option fail 0
+option malloc 0
+cmpbench RAND
+cmpbench 2
+cmpbench 8
+cmpbench 16
+cmpbench 32
+cmpbench 64
+cmpbench 256
+cmpbench 1024
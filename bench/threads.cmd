@@ -0,0 +1,25 @@
+# Benchmark the parallel q_sort on 4M random strings with 1, 2, 4 and 8 threads
+option fail 0
+option malloc 0
+option timeout 120
+option verbose 1
+option threads 1
+new
+ih RAND 4000000
+time sort
+free
+option threads 2
+new
+ih RAND 4000000
+time sort
+free
+option threads 4
+new
+ih RAND 4000000
+time sort
+free
+option threads 8
+new
+ih RAND 4000000
+time sort
+free
@@ -0,0 +1,26 @@
+# Walk queues with and without prefetching ahead. Freshly inserted elements
+# sit in allocation order, which the hardware prefetcher follows well; after a
+# shuffle every step lands somewhere else in memory, which is where software
+# prefetching has to pay off. Interned strings add a second pointer per step.
+option fail 0
+option malloc 0
+option timeout 120
+option verbose 1
+new
+ih RAND 1000000
+walkbench
+shuffle
+walkbench
+free
+option intern 1
+new
+ih RAND 1000000
+shuffle
+walkbench
+free
+option intern 0
+new
+ih RAND 4000000
+shuffle
+walkbench 3
+free
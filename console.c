@@ -13,6 +13,9 @@
 
 #include "console.h"
 #include "report.h"
+
+#define INTERNAL 1
+#include "harness.h"
 #include "web.h"
 
 /* Some global values */
@@ -178,7 +181,9 @@ static bool interpret_cmda(int argc, char *argv[])
     while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
         next_cmd = next_cmd->next;
     if (next_cmd) {
+        alloc_profile_command(next_cmd->name);
         ok = next_cmd->operation(argc, argv);
+        alloc_profile_command(NULL);
         if (!ok)
             record_error();
     } else {
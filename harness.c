@@ -1,5 +1,7 @@
 /* Test support code */
 
+#define _GNU_SOURCE /* dladdr */
+#include <dlfcn.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdint.h>
@@ -30,20 +32,92 @@
 
 /* Data structures used by our code */
 
-/* Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
- */
+/* Header in front of every allocated block */
 typedef struct __block_element {
-    struct __block_element *next, *prev;
     size_t payload_size;
     size_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
+/* Compact blocks have no header, only a 32-bit canary right behind the
+ * payload; their size lives in the table of live blocks below.
+ */
+typedef uint32_t canary_t;
+
 static size_t allocated_count = 0;
 
+/* The allocated blocks, in an open-addressing hash table keyed by payload
+ * address with linear probing, so that cautious mode can tell a live block
+ * from anything else in O(1). Empty slots have a NULL payload; the table is
+ * kept at most half full and freed whenever the last block goes.
+ */
+struct live_block {
+    void *p;
+    size_t info; /* payload size, call site and BLOCK_* flags */
+};
+
+#define BLOCK_COMPACT 1 /* no header or footer, only a canary */
+#define BLOCK_SAMPLED 2 /* poisoned and checked */
+#define BLOCK_FLAG_BITS 2
+#define BLOCK_SITE_BITS 8 /* index into sites[], 0 if not profiled */
+#define BLOCK_SIZE_SHIFT (BLOCK_FLAG_BITS + BLOCK_SITE_BITS)
+
+#define block_size(info) ((info) >> BLOCK_SIZE_SHIFT)
+#define block_site(info) \
+    (((info) >> BLOCK_FLAG_BITS) & ((1 << BLOCK_SITE_BITS) - 1))
+
+static struct live_block *live = NULL;
+static size_t live_slots = 0; /* a power of two */
+static unsigned live_shift;   /* 64 - log2(live_slots) */
+
+#define LIVE_MIN_SLOTS 1024
+
+/* Whether new blocks are compact */
+int compact_metadata = 0;
+
+/* One in how many blocks to poison and check, none if 0 */
+int poison_interval = 1;
+
+/* State of the xorshift generator picking the blocks to sample */
+static uint64_t sample_state = 0x9E3779B97F4A7C15ULL;
+
+/* Whether to attribute allocations to call sites and commands */
+int alloc_profiling = 0;
+
+/* Allocations made from one return address. The last entry of sites[] takes
+ * every call site that no longer fits.
+ */
+struct alloc_site {
+    void *addr;
+    size_t allocs, frees;
+    size_t bytes; /* allocated in total */
+    size_t live_bytes, peak_bytes;
+};
+
+#define SITE_SLOTS 512 /* of site_slot[], a power of two */
+#define MAX_SITES ((1 << BLOCK_SITE_BITS) - 1)
+
+static struct alloc_site sites[MAX_SITES + 1]; /* sites[0] stays unused */
+static size_t site_count = 0;
+static uint8_t site_slot[SITE_SLOTS]; /* hash of address to index, 0 empty */
+
+/* Allocations by size class: class k holds sizes from 2^(k-1) to 2^k - 1 */
+#define SIZE_CLASSES 65
+static size_t class_allocs[SIZE_CLASSES];
+
+/* Allocator traffic while a command of some name ran */
+struct alloc_command {
+    const char *name;
+    size_t calls, allocs, frees;
+    size_t bytes, freed_bytes;
+};
+
+#define MAX_COMMANDS 64
+static struct alloc_command commands[MAX_COMMANDS];
+static size_t command_count = 0;
+static struct alloc_command *current_command = NULL;
+
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
@@ -52,7 +126,8 @@ static bool noallocate_mode = false;
 static bool error_occurred = false;
 static char *error_message = "";
 
-static int time_limit = 1;
+/* Seconds a risky operation may run before it is interrupted */
+int time_limit = 1;
 
 /* Data for managing exceptions */
 static jmp_buf env;
@@ -74,35 +149,180 @@ static bool fail_allocation()
     return (weight < 0.01 * fail_probability);
 }
 
-/* Find header of block, given its payload.
- * Signal error if doesn't seem like legitimate block
+/* Should the next block be poisoned and checked? Uses its own generator, so
+ * that sampling leaves the sequence of random() untouched.
+ */
+static bool sample_block()
+{
+    if (poison_interval == 1)
+        return true;
+    if (poison_interval < 1)
+        return false;
+    sample_state ^= sample_state << 13;
+    sample_state ^= sample_state >> 7;
+    sample_state ^= sample_state << 17;
+    return sample_state % poison_interval == 0;
+}
+
+/* Index in sites[] of the call site returning to addr, adding it if new */
+static size_t profile_site(void *addr)
+{
+    size_t i = (((uintptr_t) addr * 0x9E3779B97F4A7C15ULL) >> 55) &
+               (SITE_SLOTS - 1);
+    for (; site_slot[i]; i = (i + 1) & (SITE_SLOTS - 1)) {
+        if (sites[site_slot[i]].addr == addr)
+            return site_slot[i];
+    }
+    if (site_count == MAX_SITES - 1)
+        return MAX_SITES;
+    site_slot[i] = ++site_count;
+    sites[site_count].addr = addr;
+    return site_count;
+}
+
+/* Size class of size bytes, its bit length */
+static size_t size_class(size_t size)
+{
+    return size ? 64 - __builtin_clzll(size) : 0;
+}
+
+/* Account for a new block of size bytes from call site addr. Returns the site
+ * index to keep with the block.
+ */
+static size_t profile_alloc(void *addr, size_t size)
+{
+    if (!alloc_profiling)
+        return 0;
+    size_t i = profile_site(addr);
+    struct alloc_site *site = &sites[i];
+    site->allocs++;
+    site->bytes += size;
+    site->live_bytes += size;
+    if (site->live_bytes > site->peak_bytes)
+        site->peak_bytes = site->live_bytes;
+    class_allocs[size_class(size)]++;
+    if (current_command) {
+        current_command->allocs++;
+        current_command->bytes += size;
+    }
+    return i;
+}
+
+/* Account for freeing a block of size bytes kept with site index i */
+static void profile_free(size_t i, size_t size)
+{
+    if (i) {
+        sites[i].frees++;
+        sites[i].live_bytes -= size;
+    }
+    if (alloc_profiling && current_command) {
+        current_command->frees++;
+        current_command->freed_bytes += size;
+    }
+}
+
+/* Home slot of payload p. Blocks within the same 64 KiB of memory get slots
+ * as close together as they are, since malloc() hands out neighbouring blocks
+ * one after the other and the queue tends to free them in the same order;
+ * Fibonacci hashing scatters the 64 KiB regions over the table.
+ */
+static size_t live_home(const void *p)
+{
+    uint64_t a = (uintptr_t) p;
+    uint64_t region = ((a >> 16) * 0x9E3779B97F4A7C15ULL) >> live_shift;
+    return (size_t) (region + (a >> 4)) & (live_slots - 1);
+}
+
+static void live_add(struct live_block b)
+{
+    size_t i = live_home(b.p);
+    while (live[i].p)
+        i = (i + 1) & (live_slots - 1);
+    live[i] = b;
+}
+
+/* Make room for one more block, doubling the table once it is half full */
+static bool live_reserve(void)
+{
+    if (live && 2 * (allocated_count + 1) <= live_slots)
+        return true;
+
+    size_t slots = live ? 2 * live_slots : LIVE_MIN_SLOTS;
+    struct live_block *old = live;
+    size_t old_slots = live_slots;
+    live = calloc(slots, sizeof(*live));
+    if (!live) {
+        live = old;
+        return false;
+    }
+    live_slots = slots;
+    live_shift = 64;
+    while (slots > 1) {
+        slots >>= 1;
+        live_shift--;
+    }
+    for (size_t i = 0; i < old_slots; i++) {
+        if (old[i].p)
+            live_add(old[i]);
+    }
+    free(old);
+    return true;
+}
+
+/* Slot holding the block with payload p, live_slots if there is none */
+static size_t live_find(const void *p)
+{
+    if (!live)
+        return live_slots;
+    for (size_t i = live_home(p); live[i].p; i = (i + 1) & (live_slots - 1)) {
+        if (live[i].p == p)
+            return i;
+    }
+    return live_slots;
+}
+
+/* Empty slot i, moving later blocks of the same probe run back into the hole
+ * so that lookups never stop short of them
  */
-static block_element_t *find_header(void *p)
+static void live_remove(size_t i)
+{
+    size_t mask = live_slots - 1;
+    for (size_t j = (i + 1) & mask; live[j].p; j = (j + 1) & mask) {
+        size_t home = live_home(live[j].p);
+        /* live[j] may fill the hole unless its home lies in (i, j] */
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            live[i] = live[j];
+            i = j;
+        }
+    }
+    live[i].p = NULL;
+}
+
+/* Find the slot of a block in the table, given its payload.
+ * Signal error if doesn't seem like legitimate block, and return live_slots if
+ * it is not one of ours at all, which is then better left alone
+ */
+static size_t find_block(void *p)
 {
     if (!p) {
         report_event(MSG_ERROR, "Attempting to free null block");
         error_occurred = true;
     }
 
-    block_element_t *b =
-        (block_element_t *) ((size_t) p - sizeof(block_element_t));
-    if (cautious_mode) {
-        /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
+    size_t slot = live_find(p);
+    if (slot == live_slots) {
+        if (cautious_mode) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
             error_occurred = true;
         }
+        return slot;
     }
 
-    if (b->magic_header != MAGICHEADER) {
+    block_element_t *b =
+        (block_element_t *) ((size_t) p - sizeof(block_element_t));
+    if (!(live[slot].info & BLOCK_COMPACT) && b->magic_header != MAGICHEADER) {
         report_event(
             MSG_ERROR,
             "Attempted to free unallocated or corrupted block.  Address = %p",
@@ -110,7 +330,7 @@ static block_element_t *find_header(void *p)
         error_occurred = true;
     }
 
-    return b;
+    return slot;
 }
 
 /* Given pointer to block, find its footer */
@@ -122,8 +342,12 @@ static size_t *find_footer(block_element_t *b)
     return p;
 }
 
-static void *alloc(alloc_t alloc_type, size_t size)
+static void *alloc(alloc_t alloc_type, size_t size, void *caller)
 {
+#ifdef NO_HARNESS
+    return alloc_type == TEST_CALLOC ? calloc(1, size) : malloc(size);
+#endif
+
     if (noallocate_mode) {
         char *msg_alloc_forbidden[] = {
             "Calls to malloc are disallowed",
@@ -142,28 +366,50 @@ static void *alloc(alloc_t alloc_type, size_t size)
         return NULL;
     }
 
-    block_element_t *new_block =
-        malloc(size + sizeof(block_element_t) + sizeof(size_t));
-    if (!new_block) {
-        report_event(MSG_FATAL, "Couldn't allocate any more memory");
-        error_occurred = true;
-    }
-
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->magic_header = MAGICHEADER;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->payload_size = size;
-    *find_footer(new_block) = MAGICFOOTER;
-    void *p = (void *) &new_block->payload;
-    memset(p, !alloc_type * FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
+    bool compact = compact_metadata;
+    void *p;
+    if (compact) {
+        p = malloc(size + sizeof(canary_t));
+        if (p && !live_reserve()) {
+            free(p);
+            p = NULL;
+        }
+        if (!p) {
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            error_occurred = true;
+            return NULL;
+        }
+        canary_t canary = MAGICFOOTER;
+        memcpy((char *) p + size, &canary, sizeof(canary));
+    } else {
+        block_element_t *new_block =
+            malloc(size + sizeof(block_element_t) + sizeof(size_t));
+        if (new_block && !live_reserve()) {
+            free(new_block);
+            new_block = NULL;
+        }
+        if (!new_block) {
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            error_occurred = true;
+        }
 
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
+        // cppcheck-suppress nullPointerRedundantCheck
+        new_block->magic_header = MAGICHEADER;
+        // cppcheck-suppress nullPointerRedundantCheck
+        new_block->payload_size = size;
+        *find_footer(new_block) = MAGICFOOTER;
+        p = (void *) &new_block->payload;
+    }
+    /* Calloc'ed blocks are always cleared, malloc'ed ones only poisoned when
+     * sampled, since filling large blocks costs as much as using them
+     */
+    bool sampled = sample_block();
+    if (alloc_type == TEST_CALLOC || sampled)
+        memset(p, !alloc_type * FILLCHAR, size);
+    size_t site = profile_alloc(caller, size);
+    live_add((struct live_block){
+        p, size << BLOCK_SIZE_SHIFT | site << BLOCK_FLAG_BITS |
+               (compact ? BLOCK_COMPACT : 0) | (sampled ? BLOCK_SAMPLED : 0)});
     allocated_count++;
 
     return p;
@@ -173,7 +419,7 @@ static void *alloc(alloc_t alloc_type, size_t size)
 
 void *test_malloc(size_t size)
 {
-    return alloc(TEST_MALLOC, size);
+    return alloc(TEST_MALLOC, size, __builtin_return_address(0));
 }
 
 // cppcheck-suppress unusedFunction
@@ -184,11 +430,16 @@ void *test_calloc(size_t nelem, size_t elsize)
      */
     if (!nelem || !elsize || nelem > SIZE_MAX / elsize)
         return NULL;
-    return alloc(TEST_CALLOC, nelem * elsize);
+    return alloc(TEST_CALLOC, nelem * elsize, __builtin_return_address(0));
 }
 
 void test_free(void *p)
 {
+#ifdef NO_HARNESS
+    free(p);
+    return;
+#endif
+
     if (noallocate_mode) {
         report_event(MSG_FATAL, "Calls to free disallowed");
         return;
@@ -197,38 +448,52 @@ void test_free(void *p)
     if (!p)
         return;
 
-    block_element_t *b = find_header(p);
-    size_t footer = *find_footer(b);
-    if (footer != MAGICFOOTER) {
-        report_event(MSG_ERROR,
-                     "Corruption detected in block with address %p when "
-                     "attempting to free it",
-                     p);
-        error_occurred = true;
+    size_t slot = find_block(p);
+    if (slot == live_slots)
+        return;
+    size_t size = block_size(live[slot].info);
+    bool compact = live[slot].info & BLOCK_COMPACT;
+    bool sampled = live[slot].info & BLOCK_SAMPLED;
+    void *block = compact ? p : (char *) p - sizeof(block_element_t);
+    if (sampled) {
+        bool intact;
+        if (compact) {
+            canary_t canary;
+            memcpy(&canary, (char *) p + size, sizeof(canary));
+            intact = canary == (canary_t) MAGICFOOTER;
+            canary = MAGICFREE;
+            memcpy((char *) p + size, &canary, sizeof(canary));
+        } else {
+            intact = *find_footer(block) == MAGICFOOTER;
+            *find_footer(block) = MAGICFREE;
+        }
+        if (!intact) {
+            report_event(MSG_ERROR,
+                         "Corruption detected in block with address %p when "
+                         "attempting to free it",
+                         p);
+            error_occurred = true;
+        }
+        memset(p, FILLCHAR, size);
+    }
+    if (!compact)
+        ((block_element_t *) block)->magic_header = MAGICFREE;
+
+    profile_free(block_site(live[slot].info), size);
+    live_remove(slot);
+    free(block);
+    if (!--allocated_count) {
+        free(live);
+        live = NULL;
+        live_slots = 0;
     }
-    b->magic_header = MAGICFREE;
-    *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
-
-    /* Unlink from list */
-    block_element_t *bn = b->next;
-    block_element_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
-
-    free(b);
-    allocated_count--;
 }
 
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    void *new = alloc(TEST_MALLOC, len, __builtin_return_address(0));
     if (!new)
         return NULL;
 
@@ -240,6 +505,88 @@ size_t allocation_check()
     return allocated_count;
 }
 
+/* Attribute what follows to command name, or to none if NULL */
+void alloc_profile_command(const char *name)
+{
+    current_command = NULL;
+    if (!alloc_profiling || !name)
+        return;
+
+    size_t i = 0;
+    while (i < command_count && strcmp(commands[i].name, name))
+        i++;
+    if (i == command_count) {
+        if (command_count == MAX_COMMANDS)
+            return;
+        commands[command_count++].name = name;
+    }
+    current_command = &commands[i];
+    current_command->calls++;
+}
+
+/* Name call site addr as executable+offset, which addr2line understands */
+static void site_name(void *addr, char *buf, size_t len)
+{
+    Dl_info info;
+    if (!addr) {
+        snprintf(buf, len, "other");
+    } else if (dladdr(addr, &info) && info.dli_fname) {
+        const char *file = strrchr(info.dli_fname, '/');
+        snprintf(buf, len, "%s+%#tx", file ? file + 1 : info.dli_fname,
+                 (char *) addr - (char *) info.dli_fbase);
+    } else {
+        snprintf(buf, len, "%p", addr);
+    }
+}
+
+void alloc_profile_report(bool dump)
+{
+    char name[64];
+
+    if (!dump)
+        report(1, "%-24s %10s %10s %14s %14s %14s", "Call site", "Allocs",
+               "Frees", "Bytes", "Live bytes", "Peak bytes");
+    for (size_t i = 1; i <= MAX_SITES; i++) {
+        struct alloc_site *site = &sites[i];
+        if (!site->allocs)
+            continue;
+        site_name(site->addr, name, sizeof(name));
+        report(1,
+               dump ? "memstat\tsite\t%s\tallocs=%zu\tfrees=%zu\tbytes=%zu\t"
+                      "live_bytes=%zu\tpeak_bytes=%zu"
+                    : "%-24s %10zu %10zu %14zu %14zu %14zu",
+               name, site->allocs, site->frees, site->bytes, site->live_bytes,
+               site->peak_bytes);
+    }
+
+    if (!dump)
+        report(1, "\n%-24s %10s", "Size", "Allocs");
+    for (size_t k = 0; k < SIZE_CLASSES; k++) {
+        if (!class_allocs[k])
+            continue;
+        size_t low = k ? (size_t) 1 << (k - 1) : 0;
+        size_t high = k ? ((size_t) 2 << (k - 1)) - 1 : 0;
+        snprintf(name, sizeof(name), "%zu-%zu", low, high);
+        report(1, dump ? "memstat\tsize\t%s\tallocs=%zu" : "%-24s %10zu", name,
+               class_allocs[k]);
+    }
+
+    if (!dump)
+        report(1, "\n%-24s %10s %10s %10s %14s %14s", "Command", "Calls",
+               "Allocs", "Frees", "Bytes", "Freed bytes");
+    for (size_t i = 0; i < command_count; i++) {
+        struct alloc_command *cmd = &commands[i];
+        if (!cmd->allocs && !cmd->frees)
+            continue;
+        report(1,
+               dump ? "memstat\tcommand\t%s\tcalls=%zu\tallocs=%zu\t"
+                      "frees=%zu\tbytes=%zu\tfreed_bytes=%zu"
+                    : "%-24s %10zu %10zu %10zu %14zu %14zu",
+               cmd->name, cmd->calls, cmd->allocs, cmd->frees, cmd->bytes,
+               cmd->freed_bytes);
+    }
+}
+
 /* Implementation of functions for testing */
 
 /* Set/unset cautious mode.
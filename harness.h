@@ -16,6 +16,10 @@ void test_free(void *p);
 char *test_strdup(const char *s);
 /* FIXME: provide test_realloc as well */
 
+/* Built with NO_HARNESS, the functions above call the C library and check
+ * nothing, and the tested program calls it directly.
+ */
+
 #ifdef INTERNAL
 
 /* Report number of allocated blocks */
@@ -24,6 +28,35 @@ size_t allocation_check();
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* Whether new blocks keep their size in a side table and only a 4-byte canary
+ * inline, rather than a header and a footer, so that the memory footprint is
+ * close to that of plain malloc(). Takes effect from the next allocation.
+ */
+extern int compact_metadata;
+
+/* One in how many new blocks to fill with a poison pattern and to check for
+ * overruns when freed, chosen at random; 1 for every block, 0 for none.
+ * Leaks, double frees and foreign pointers are caught either way.
+ */
+extern int poison_interval;
+
+/* Whether to record which call sites and commands allocate, and how much */
+extern int alloc_profiling;
+
+/* Attribute allocations from now on to the command called name, which must
+ * stay valid, or to no command if name is NULL
+ */
+void alloc_profile_command(const char *name);
+
+/* Report allocations by call site, size class and command, as a table or, if
+ * dump is set, as one tab-separated "memstat" line per entry. Call sites are
+ * return addresses, shown as executable+offset for addr2line.
+ */
+void alloc_profile_report(bool dump);
+
+/* Number of seconds a risky operation may take before it is aborted */
+extern int time_limit;
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -51,7 +84,7 @@ void exception_cancel();
  */
 void trigger_exception(char *msg);
 
-#else /* !INTERNAL */
+#elif !defined(NO_HARNESS)
 
 /* Tested program use our versions of malloc and free */
 #define malloc test_malloc
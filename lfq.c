@@ -0,0 +1,273 @@
+/* Lock-free multi-producer/multi-consumer queue, see lfq.h */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The harness allocator keeps unsynchronized bookkeeping, so this module uses
+ * the C library's malloc and free.
+ */
+#define INTERNAL 1
+#include "harness.h"
+
+#include "lfq.h"
+
+struct lfq_node {
+    _Atomic(struct lfq_node *) next;
+    element_t *e;             /* NULL in the dummy node */
+    struct lfq_node *retired; /* link in a hazard record's retired list */
+};
+
+struct lfq {
+    /* Producers and consumers hammer different ends, keep them apart */
+    _Alignas(64) _Atomic(struct lfq_node *) head;
+    _Alignas(64) _Atomic(struct lfq_node *) tail;
+};
+
+/* Hazard pointers.
+ *
+ * Every thread that touches a queue owns a record holding the nodes it is
+ * about to dereference. A node unlinked by a consumer is put on that thread's
+ * retired list, and the list is scanned once it holds HP_SCAN_THRESHOLD nodes:
+ * nodes that no record points at are freed, the others wait for the next
+ * scan. Records are never freed. A thread gives its record up when it exits,
+ * and the next thread to come along takes it over together with whatever
+ * was still waiting on it.
+ */
+#define HP_PER_THREAD 2
+#define HP_SCAN_THRESHOLD 64
+
+struct hp_record {
+    _Atomic(struct lfq_node *) hp[HP_PER_THREAD];
+    atomic_bool active;
+    struct hp_record *next; /* fixed once the record is published */
+    struct lfq_node *retired;
+    size_t nretired;
+};
+
+static _Atomic(struct hp_record *) hp_records;
+static pthread_key_t hp_key;
+static pthread_once_t hp_once = PTHREAD_ONCE_INIT;
+static _Thread_local struct hp_record *hp_self;
+
+static bool hp_hazardous(const struct lfq_node *node)
+{
+    for (struct hp_record *r = atomic_load(&hp_records); r; r = r->next) {
+        for (int i = 0; i < HP_PER_THREAD; i++) {
+            if (atomic_load(&r->hp[i]) == node)
+                return true;
+        }
+    }
+    return false;
+}
+
+/* Free every retired node of r that no thread points at */
+static void hp_scan(struct hp_record *r)
+{
+    struct lfq_node *list = r->retired;
+
+    r->retired = NULL;
+    r->nretired = 0;
+    while (list) {
+        struct lfq_node *node = list;
+        list = node->retired;
+        if (hp_hazardous(node)) {
+            node->retired = r->retired;
+            r->retired = node;
+            r->nretired++;
+        } else {
+            free(node);
+        }
+    }
+}
+
+/* Thread exit: drop the hazards and hand the record back */
+static void hp_release(void *arg)
+{
+    struct hp_record *r = arg;
+
+    for (int i = 0; i < HP_PER_THREAD; i++)
+        atomic_store(&r->hp[i], NULL);
+    hp_scan(r);
+    atomic_store(&r->active, false);
+}
+
+static void hp_init(void)
+{
+    pthread_key_create(&hp_key, hp_release);
+}
+
+/* Record of the calling thread, NULL if none could be set up */
+static struct hp_record *hp_get(void)
+{
+    if (hp_self)
+        return hp_self;
+
+    pthread_once(&hp_once, hp_init);
+    struct hp_record *r;
+    for (r = atomic_load(&hp_records); r; r = r->next) {
+        bool idle = false;
+        if (atomic_compare_exchange_strong(&r->active, &idle, true))
+            break;
+    }
+    if (!r) {
+        r = calloc(1, sizeof(*r));
+        if (!r)
+            return NULL;
+        atomic_init(&r->active, true);
+        struct hp_record *first = atomic_load(&hp_records);
+        do
+            r->next = first;
+        while (!atomic_compare_exchange_weak(&hp_records, &first, r));
+    }
+    pthread_setspecific(hp_key, r);
+    hp_self = r;
+    return r;
+}
+
+static void hp_retire(struct hp_record *r, struct lfq_node *node)
+{
+    node->retired = r->retired;
+    r->retired = node;
+    if (++r->nretired >= HP_SCAN_THRESHOLD)
+        hp_scan(r);
+}
+
+/* Load *src into hazard slot i until the two agree, so that the node cannot
+ * have been retired and freed in between.
+ */
+static struct lfq_node *hp_protect(struct hp_record *r,
+                                   int i,
+                                   _Atomic(struct lfq_node *) *src)
+{
+    struct lfq_node *node = atomic_load(src), *again;
+
+    for (;;) {
+        atomic_store(&r->hp[i], node);
+        again = atomic_load(src);
+        if (again == node)
+            return node;
+        node = again;
+    }
+}
+
+lfq_t *lfq_new(void)
+{
+    lfq_t *q = malloc(sizeof(lfq_t));
+    struct lfq_node *dummy = malloc(sizeof(struct lfq_node));
+    if (!q || !dummy) {
+        free(q);
+        free(dummy);
+        return NULL;
+    }
+    atomic_init(&dummy->next, NULL);
+    dummy->e = NULL;
+    atomic_init(&q->head, dummy);
+    atomic_init(&q->tail, dummy);
+    return q;
+}
+
+void lfq_free(lfq_t *q)
+{
+    if (!q)
+        return;
+    struct lfq_node *node = atomic_load(&q->head);
+    /* The dummy's element, if any, has already been handed out */
+    struct lfq_node *next = atomic_load(&node->next);
+    free(node);
+    for (node = next; node; node = next) {
+        next = atomic_load(&node->next);
+        lfq_release_element(node->e);
+        free(node);
+    }
+    free(q);
+}
+
+bool lfq_insert_tail(lfq_t *q, const char *s)
+{
+    struct hp_record *r = q && s ? hp_get() : NULL;
+    if (!r)
+        return false;
+
+    size_t len = strlen(s);
+    element_t *e = malloc(sizeof(element_t) + len + 1);
+    struct lfq_node *node = malloc(sizeof(struct lfq_node));
+    if (!e || !node) {
+        free(e);
+        free(node);
+        return false;
+    }
+    memcpy(e->data, s, len + 1);
+    e->value = e->data;
+    INIT_LIST_HEAD(&e->list);
+    e->chunk = NULL;
+    e->key = element_key(s, len);
+    atomic_init(&node->next, NULL);
+    node->e = e;
+
+    for (;;) {
+        struct lfq_node *tail = hp_protect(r, 0, &q->tail);
+        struct lfq_node *next = atomic_load(&tail->next);
+        if (tail != atomic_load(&q->tail))
+            continue;
+        if (next) {
+            /* Someone appended but has not swung the tail yet; help */
+            atomic_compare_exchange_strong(&q->tail, &tail, next);
+            continue;
+        }
+        if (atomic_compare_exchange_strong(&tail->next, &next, node)) {
+            atomic_compare_exchange_strong(&q->tail, &tail, node);
+            break;
+        }
+    }
+    atomic_store(&r->hp[0], NULL);
+    return true;
+}
+
+element_t *lfq_remove_head(lfq_t *q, char *sp, size_t bufsize)
+{
+    struct hp_record *r = q ? hp_get() : NULL;
+    if (!r)
+        return NULL;
+
+    struct lfq_node *head, *next;
+    element_t *e;
+    for (;;) {
+        head = hp_protect(r, 0, &q->head);
+        struct lfq_node *tail = atomic_load(&q->tail);
+        next = atomic_load(&head->next);
+        atomic_store(&r->hp[1], next);
+        if (head != atomic_load(&q->head))
+            continue;
+        if (!next) {
+            e = NULL;
+            break;
+        }
+        if (head == tail) {
+            atomic_compare_exchange_strong(&q->tail, &tail, next);
+            continue;
+        }
+        /* next becomes the new dummy; its element is ours if we win */
+        e = next->e;
+        if (atomic_compare_exchange_strong(&q->head, &head, next))
+            break;
+    }
+    atomic_store(&r->hp[0], NULL);
+    atomic_store(&r->hp[1], NULL);
+    if (!e)
+        return NULL;
+
+    hp_retire(r, head);
+    if (sp && bufsize > 0) {
+        strncpy(sp, e->value, bufsize - 1);
+        sp[bufsize - 1] = '\0';
+    }
+    return e;
+}
+
+void lfq_release_element(element_t *e)
+{
+    free(e);
+}
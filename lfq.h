@@ -0,0 +1,66 @@
+#ifndef LAB0_LFQ_H
+#define LAB0_LFQ_H
+
+/* Lock-free multi-producer/multi-consumer FIFO of element_t.
+ *
+ * This is the queue of Michael and Scott: a singly-linked list with a dummy
+ * node in front, where producers append with compare-and-swap on the last
+ * node and consumers advance the head the same way. Unlinked nodes are freed
+ * through hazard pointers, so a thread still looking at a node never sees it
+ * go away underneath it, and no node is reused while someone may compare
+ * against it.
+ *
+ * Unlike the queues of queue.h, these elements are allocated with the C
+ * library allocator, since the test harness is not thread-safe. Elements
+ * handed out by lfq_remove_head() belong to the caller and are given back with
+ * lfq_release_element().
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "queue.h"
+
+typedef struct lfq lfq_t;
+
+/**
+ * lfq_new() - Create an empty lock-free queue
+ *
+ * Return: NULL for allocation failed
+ */
+lfq_t *lfq_new(void);
+
+/**
+ * lfq_free() - Free a lock-free queue and every element still in it
+ * @q: queue to free, no effect if NULL
+ *
+ * No other thread may use the queue any more.
+ */
+void lfq_free(lfq_t *q);
+
+/**
+ * lfq_insert_tail() - Append a copy of a string, safe from any thread
+ * @q: queue
+ * @s: string to be stored
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool lfq_insert_tail(lfq_t *q, const char *s);
+
+/**
+ * lfq_remove_head() - Take the oldest element, safe from any thread
+ * @q: queue
+ * @sp: if non-NULL, receives a copy of the removed string
+ * @bufsize: size of @sp, the copy is truncated to bufsize - 1 characters
+ *
+ * Return: the removed element, %NULL if the queue is NULL or was empty
+ */
+element_t *lfq_remove_head(lfq_t *q, char *sp, size_t bufsize);
+
+/**
+ * lfq_release_element() - Free an element taken from a lock-free queue
+ * @e: element returned by lfq_remove_head()
+ */
+void lfq_release_element(element_t *e);
+
+#endif /* LAB0_LFQ_H */
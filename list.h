@@ -452,6 +452,109 @@ static inline void list_move_tail(struct list_head *node,
         safe = list_entry(safe->member.next, typeof(*entry), member))
 #endif
 
+/**
+ * list_prefetch() - Hint that the memory at an address is about to be read
+ * @addr: address to fetch into the cache; it is never dereferenced, so it may
+ *        be anything, including NULL
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define list_prefetch(addr) __builtin_prefetch(addr)
+#else
+#define list_prefetch(addr) ((void) (addr))
+#endif
+
+/* Number of nodes the prefetching iterators stay ahead of the current one */
+#ifndef LIST_PREFETCH_HOPS
+#define LIST_PREFETCH_HOPS 4
+#endif
+
+/**
+ * list_prefetch_next() - Move a prefetch cursor one node further
+ * @head: pointer to the head of the list
+ * @ahead: the cursor, which stops once it reaches @head
+ *
+ * Return: the node after @ahead, now being prefetched, or @head
+ */
+static inline struct list_head *list_prefetch_next(
+    const struct list_head *head,
+    struct list_head *ahead)
+{
+    if (ahead != head) {
+        ahead = ahead->next;
+        list_prefetch(ahead);
+    }
+    return ahead;
+}
+
+/**
+ * list_prefetch_ahead() - Start a prefetch cursor a few nodes past a node
+ * @head: pointer to the head of the list
+ * @node: node the iteration starts from
+ *
+ * Return: the node LIST_PREFETCH_HOPS nodes after @node, or @head if the list
+ * ends before that
+ */
+static inline struct list_head *list_prefetch_ahead(
+    const struct list_head *head,
+    struct list_head *node)
+{
+    for (int i = 0; i < LIST_PREFETCH_HOPS; i++)
+        node = list_prefetch_next(head, node);
+    return node;
+}
+
+/**
+ * list_for_each_prefetch - Iterate over list nodes, prefetching ahead
+ * @node: list_head pointer used as iterator
+ * @ahead: list_head pointer used as prefetch cursor
+ * @head: pointer to the head of the list
+ *
+ * Like list_for_each(), but @ahead runs LIST_PREFETCH_HOPS nodes in front of
+ * @node and asks for each node it reaches to be prefetched. Every step still
+ * has to wait for the next pointer, but when the nodes are scattered over
+ * memory the work done on @node can overlap with fetching the nodes after it.
+ */
+#define list_for_each_prefetch(node, ahead, head)                      \
+    for (node = (head)->next, ahead = list_prefetch_ahead(head, node); \
+         node != (head);                                               \
+         node = node->next, ahead = list_prefetch_next(head, ahead))
+
+/**
+ * list_for_each_entry_prefetch - Iterate over entries, prefetching ahead
+ * @entry: Pointer to the structure type, used as the loop iterator.
+ * @ahead: list_head pointer used as prefetch cursor
+ * @head: Pointer to the list_head structure representing the list head.
+ * @member: Name of the list_head member within the structure type of @entry.
+ *
+ * Like list_for_each_entry(), prefetching as list_for_each_prefetch() does.
+ */
+#if __LIST_HAVE_TYPEOF
+#define list_for_each_entry_prefetch(entry, ahead, head, member)         \
+    for (entry = list_entry((head)->next, typeof(*entry), member),       \
+        ahead = list_prefetch_ahead(head, &entry->member);               \
+         &entry->member != (head);                                       \
+         entry = list_entry(entry->member.next, typeof(*entry), member), \
+        ahead = list_prefetch_next(head, ahead))
+#endif
+
+/**
+ * list_for_each_safe_prefetch - Iterate over nodes, allowing removal and
+ *                               prefetching ahead
+ * @node: Pointer to a list_head structure, used as the loop iterator.
+ * @safe: Pointer to a list_head structure, storing the next node for safe
+ *        iteration.
+ * @ahead: list_head pointer used as prefetch cursor
+ * @head: Pointer to the list_head structure representing the list head.
+ *
+ * Like list_for_each_safe(), prefetching as list_for_each_prefetch() does.
+ * The cursor never falls back onto @node, so @node may be removed and freed.
+ */
+#define list_for_each_safe_prefetch(node, safe, ahead, head) \
+    for (node = (head)->next, safe = node->next,             \
+        ahead = list_prefetch_ahead(head, node);             \
+         node != (head); node = safe, safe = node->next,     \
+        ahead = list_prefetch_next(head, ahead))
+
 #undef __LIST_HAVE_TYPEOF
 
 #ifdef __cplusplus
@@ -3,8 +3,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <spawn.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -46,7 +49,9 @@ extern int show_entropy;
 #include "queue.h"
 
 #include "console.h"
+#include "lfq.h"
 #include "report.h"
+#include "simd_strcmp.h"
 
 /* Settable parameters */
 
@@ -54,7 +59,6 @@ extern int show_entropy;
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST_SIZE 30
 
@@ -102,9 +106,6 @@ static bool do_free(int argc, char *argv[])
     }
     error_check();
 
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
-
     struct list_head *qnext = NULL;
     if (chain.size > 1) {
         qnext = (current->chain.next == &chain.head) ? chain.head.next
@@ -117,7 +118,6 @@ static bool do_free(int argc, char *argv[])
         if (exception_setup(true))
             q_free(current->q);
         exception_cancel();
-        set_cautious_mode(true);
     }
 
     if (current) {
@@ -181,6 +181,28 @@ static void fill_rand_string(char *buf, size_t buf_size)
     buf[len] = '\0';
 }
 
+/* Largest number of strings inserted in one call */
+#define INSERT_BATCH 256
+
+/* fill_rand_string() for n buffers of MAX_RANDSTR_LEN bytes, taking all the
+ * random bytes from one randombytes() call rather than one call per string
+ */
+static void fill_rand_strings(char (*bufs)[MAX_RANDSTR_LEN], int n)
+{
+    static uint64_t randstr_buf_64[INSERT_BATCH * MAX_RANDSTR_LEN];
+    size_t bytes = n * MAX_RANDSTR_LEN * sizeof(*randstr_buf_64);
+    randombytes((uint8_t *) randstr_buf_64, bytes);
+    for (int i = 0; i < n; i++) {
+        const uint64_t *r = randstr_buf_64 + i * MAX_RANDSTR_LEN;
+        size_t len = 0;
+        while (len < MIN_RANDSTR_LEN)
+            len = rand() % MAX_RANDSTR_LEN;
+        for (size_t k = 0; k < len; k++)
+            bufs[i][k] = charset[r[k] % (sizeof(charset) - 1)];
+        bufs[i][len] = '\0';
+    }
+}
+
 static void fill_rand_string_xorshift(char *buf, size_t buf_size)
 {
     size_t len = 0;
@@ -215,10 +237,10 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
     }
 
     char *lasts = NULL;
-    char randstr_buf[MAX_RANDSTR_LEN];
-    char xorshiftstr_buf[MAX_RANDSTR_LEN];
+    char randstr_buf[INSERT_BATCH][MAX_RANDSTR_LEN];
+    char *strs[INSERT_BATCH];
     int reps = 1;
-    bool ok = true, need_rand = false;
+    bool ok = true, need_rand = false, xorshift = false;
     if (argc != 2 && argc != 3) {
         report(1, "%s needs 1-2 arguments", argv[0]);
         return false;
@@ -232,50 +254,61 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
         }
     }
 
-    if (!strcmp(inserts, "RAND")) {
+    if (!strcmp(inserts, "RAND"))
         need_rand = true;
-        inserts = randstr_buf;
-    }
 
-    if (!strcmp(inserts, "xorshift")) {
-        need_rand = true;
-        inserts = xorshiftstr_buf;
-    }
+    if (!strcmp(inserts, "xorshift"))
+        need_rand = xorshift = true;
 
     if (!current || !current->q)
         report(3, "Warning: Calling insert %s on null queue",
                pos == POS_TAIL ? "tail" : "head");
     error_check();
 
+    /* Repeated insertions go in INSERT_BATCH at a time through the bulk
+     * functions, so the checks below run once per batch.
+     */
     if (current && exception_setup(true)) {
-        for (int r = 0; ok && r < reps; r++) {
-            if (need_rand) {
-                if (inserts == randstr_buf) {
-                    fill_rand_string(randstr_buf, sizeof(randstr_buf));
-                } else if (inserts == xorshiftstr_buf) {
-                    fill_rand_string_xorshift(xorshiftstr_buf,
-                                              sizeof(xorshiftstr_buf));
-                }
+        for (int r = 0; ok && r < reps;) {
+            int batch = reps - r < INSERT_BATCH ? reps - r : INSERT_BATCH;
+            if (need_rand && !xorshift)
+                fill_rand_strings(randstr_buf, batch);
+            for (int i = 0; i < batch; i++) {
+                strs[i] = need_rand ? randstr_buf[i] : inserts;
+                if (xorshift)
+                    fill_rand_string_xorshift(strs[i], MAX_RANDSTR_LEN);
             }
-            bool rval = pos == POS_TAIL ? q_insert_tail(current->q, inserts)
-                                        : q_insert_head(current->q, inserts);
+            char *newest = strs[batch - 1];
+            bool rval;
+            if (batch == 1)
+                rval = pos == POS_TAIL ? q_insert_tail(current->q, newest)
+                                       : q_insert_head(current->q, newest);
+            else
+                rval = pos == POS_TAIL
+                           ? q_insert_tail_bulk(current->q, strs, batch)
+                           : q_insert_head_bulk(current->q, strs, batch);
             if (rval) {
-                current->size++;
-                element_t *entry =
-                    pos == POS_TAIL
-                        ? list_last_entry(current->q, element_t, list)
-                        : list_first_entry(current->q, element_t, list);
-                char *cur_inserts = entry->value;
+                current->size += batch;
+                /* The element inserted last, and the one before it */
+                struct list_head *node =
+                    pos == POS_TAIL ? q_last(current->q) : q_first(current->q);
+                struct list_head *prev = q_next(current->q, node);
+                if (pos == POS_TAIL)
+                    prev = q_reversed(current->q) ? node->next : node->prev;
+                char *cur_inserts = list_entry(node, element_t, list)->value;
+                if (batch > 1)
+                    lasts = list_entry(prev, element_t, list)->value;
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
                     ok = false;
-                } else if (r == 0 && inserts == cur_inserts) {
+                } else if (r == 0 && newest == cur_inserts) {
                     report(1,
                            "ERROR: Need to allocate and copy string for new "
                            "queue element");
                     ok = false;
                     break;
-                } else if (r == 1 && lasts == cur_inserts) {
+                } else if ((r > 0 || batch > 1) && lasts == cur_inserts &&
+                           !q_intern) {
                     report(1,
                            "ERROR: Need to allocate separate string for each "
                            "queue element");
@@ -285,15 +318,26 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                 lasts = cur_inserts;
             } else {
                 fail_count++;
-                if (fail_count < fail_limit)
-                    report(2, "Insertion of %s failed", inserts);
-                else {
-                    report(1,
-                           "ERROR: Insertion of %s failed (%d failures total)",
-                           inserts, fail_count);
+                if (fail_count < fail_limit) {
+                    if (batch == 1)
+                        report(2, "Insertion of %s failed", newest);
+                    else
+                        report(2, "Insertion of %d strings failed", batch);
+                } else {
+                    if (batch == 1)
+                        report(1,
+                               "ERROR: Insertion of %s failed (%d failures "
+                               "total)",
+                               newest, fail_count);
+                    else
+                        report(1,
+                               "ERROR: Insertion of %d strings failed (%d "
+                               "failures total)",
+                               batch, fail_count);
                     ok = false;
                 }
             }
+            r += batch;
             ok = ok && !error_check();
         }
     }
@@ -315,6 +359,50 @@ static bool do_it(int argc, char *argv[])
     return queue_insert(POS_TAIL, argc, argv);
 }
 
+/* Buffer the removed strings are copied to: string_length + 1 bytes for the
+ * string, then STRINGPAD bytes to catch overflows. It is kept from one removal
+ * to the next and holds 'X' everywhere but in its first byte, so that each
+ * removal only has to put back the bytes the copy wrote.
+ */
+static char *remove_buf;
+static int remove_buf_length = -1;
+
+static char *remove_buffer(void)
+{
+    if (remove_buf_length != string_length) {
+        free(remove_buf);
+        remove_buf_length = -1;
+        remove_buf = malloc(string_length + STRINGPAD + 1);
+        if (!remove_buf)
+            return NULL;
+        memset(remove_buf, 'X', string_length + STRINGPAD);
+        remove_buf[string_length + STRINGPAD] = '\0';
+        remove_buf_length = string_length;
+    }
+    remove_buf[0] = '\0';
+    return remove_buf;
+}
+
+/* Whether the removal buffer holds nothing but 'X' from offset from on */
+static bool remove_buffer_intact(const char *buf, size_t from)
+{
+    size_t end = string_length + STRINGPAD;
+    /* Each byte equal to the one after it, and the last one an 'X' */
+    return from >= end ||
+           (buf[end - 1] == 'X' &&
+            !memcmp(buf + from, buf + from + 1, end - 1 - from));
+}
+
+/* Put the initial 'X' back where the last removal wrote, or everywhere if it
+ * may have written past the string
+ */
+static void remove_buffer_reset(bool all)
+{
+    size_t end = string_length + STRINGPAD;
+    size_t n = all ? end : strlen(remove_buf) + 1;
+    memset(remove_buf, 'X', n < end ? n : end);
+}
+
 static bool queue_remove(position_t pos, int argc, char *argv[])
 {
     /* FIXME: It is known that both functions is_remove_tail_const() and
@@ -344,7 +432,7 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
         return false;
     }
 
-    char *removes = malloc(string_length + STRINGPAD + 1);
+    char *removes = remove_buffer();
     if (!removes) {
         report(1,
                "INTERNAL ERROR.  Could not allocate space for removed strings");
@@ -355,7 +443,6 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
     if (!checks) {
         report(1,
                "INTERNAL ERROR.  Could not allocate space for removed strings");
-        free(removes);
         return false;
     }
 
@@ -366,42 +453,48 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
         checks[string_length] = '\0';
     }
 
-    removes[0] = '\0';
-    memset(removes + 1, 'X', string_length + STRINGPAD - 1);
-    removes[string_length + STRINGPAD] = '\0';
-
     if (!current || !current->size)
         report(3, "Warning: Calling remove %s on empty queue",
                pos == POS_TAIL ? "tail" : "head");
     error_check();
 
     element_t *re = NULL;
+    size_t len = 0;
     if (current && exception_setup(true))
-        re = pos == POS_TAIL
-                 ? q_remove_tail(current->q, removes, string_length + 1)
-                 : q_remove_head(current->q, removes, string_length + 1);
+        re = pos == POS_TAIL ? q_remove_tail_len(current->q, removes,
+                                                 string_length + 1, &len)
+                             : q_remove_head_len(current->q, removes,
+                                                 string_length + 1, &len);
     exception_cancel();
 
     bool is_null = re ? false : true;
+    bool intact = true;
 
     if (!is_null) {
+        /* The removed string is borrowed from the element until it is
+         * released, so its length can be checked against it first
+         */
+        if (len != strlen(re->value)) {
+            report(1, "ERROR: Removed string has length %zu, not %zu",
+                   strlen(re->value), len);
+            ok = false;
+        }
         // q_remove_head and q_remove_tail are not responsible for releasing
         // node
         q_release_element(re);
 
+        size_t copied = len < (size_t) string_length ? len : string_length;
         removes[string_length + STRINGPAD] = '\0';
         if (removes[0] == '\0') {
             report(1, "ERROR: Failed to store removed value");
             ok = false;
         }
 
-        /* Check whether padding in array removes are still initial value 'X'.
-         * If there's other character in padding, it's overflowed.
+        /* Everything past the terminator must still hold the initial 'X'.
+         * If there's other character in it, the copy overflowed.
          */
-        int i = string_length + 1;
-        while ((i < string_length + STRINGPAD) && (removes[i] == 'X'))
-            i++;
-        if (i != string_length + STRINGPAD) {
+        intact = remove_buffer_intact(removes, copied + 1);
+        if (!intact) {
             report(1,
                    "ERROR: copying of string in remove_head overflowed "
                    "destination buffer.");
@@ -429,13 +522,73 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
 
     q_show(3);
 
-    free(removes);
+    remove_buffer_reset(!intact);
     free(checks);
     return ok && !error_check();
 }
 
+/* Remove n elements from the head in one call to q_remove_head_n() */
+static bool queue_remove_n(int argc, char *argv[])
+{
+    int n;
+    if (!get_int(argv[2], &n) || n < 1) {
+        report(1, "Invalid number of removals '%s'", argv[2]);
+        return false;
+    }
+    bool check = strcmp(argv[1], "RAND");
+
+    if (!current || !current->size)
+        report(3, "Warning: Calling remove head on empty queue");
+    error_check();
+
+    LIST_HEAD(removed);
+    int got = 0;
+    if (current && exception_setup(true))
+        got = q_remove_head_n(current->q, n, &removed);
+    exception_cancel();
+
+    bool ok = true;
+    int count = 0;
+    element_t *e, *safe;
+    list_for_each_entry_safe (e, safe, &removed, list) {
+        if (count++ == 0 && check && strcmp(e->value, argv[1])) {
+            report(1, "ERROR: Removed value %s != expected value %s", e->value,
+                   argv[1]);
+            ok = false;
+        }
+        q_release_element(e);
+    }
+    if (count != got) {
+        report(1, "ERROR: Removed %d elements but %d were returned", got,
+               count);
+        ok = false;
+    }
+    if (current)
+        current->size -= count;
+
+    if (got < n) {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Removed %d of %d elements from queue", got, n);
+        } else {
+            report(1,
+                   "ERROR: Removed %d of %d elements from queue (%d failures "
+                   "total)",
+                   got, n, fail_count);
+            ok = false;
+        }
+    } else {
+        report(2, "Removed %d elements from queue", got);
+    }
+
+    q_show(3);
+    return ok && !error_check();
+}
+
 static inline bool do_rh(int argc, char *argv[])
 {
+    if (argc == 3 && !simulation)
+        return queue_remove_n(argc, argv);
     return queue_remove(POS_HEAD, argc, argv);
 }
 
@@ -461,7 +614,8 @@ static bool do_dedup(int argc, char *argv[])
 
     // Copy current->q to l_copy
     if (current->q && !list_empty(current->q)) {
-        list_for_each_entry (item, current->q, list) {
+        struct list_head *ahead;
+        q_for_each_entry_prefetch (item, ahead, current->q) {
             size_t slen;
             tmp = malloc(sizeof(element_t));
             if (!tmp)
@@ -503,7 +657,7 @@ static bool do_dedup(int argc, char *argv[])
         return false;
     }
 
-    struct list_head *l_tmp = current->q->next;
+    struct list_head *l_tmp = q_first(current->q);
     bool is_this_dup = false;
     // Compare between new list and old one
     list_for_each_entry (item, &l_copy, list) {
@@ -518,7 +672,7 @@ static bool do_dedup(int argc, char *argv[])
         } else if (l_tmp != current->q &&
                    strcmp(list_entry(l_tmp, element_t, list)->value,
                           item->value) == 0)
-            l_tmp = l_tmp->next;
+            l_tmp = q_next(current->q, l_tmp);
         else
             ok = false;
         is_this_dup = is_next_dup;
@@ -631,7 +785,7 @@ bool do_sort(int argc, char *argv[])
     unsigned no = 0;
     if (current && current->size && current->size <= MAX_NODES) {
         element_t *entry;
-        list_for_each_entry (entry, current->q, list)
+        q_for_each_entry (entry, current->q)
             nodes[no++] = &entry->list;
     } else if (current && current->size > MAX_NODES)
         report(1,
@@ -646,12 +800,16 @@ bool do_sort(int argc, char *argv[])
 
     bool ok = true;
     if (current && current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --cnt; cur_l = cur_l->next) {
+        struct list_head *ahead =
+            q_prefetch_ahead(current->q, q_first(current->q));
+        for (struct list_head *cur_l = q_first(current->q);
+             cur_l != current->q && --cnt;
+             cur_l = q_next(current->q, cur_l),
+             ahead = q_prefetch_next(current->q, ahead)) {
             /* Ensure each element in ascending/descending order */
             element_t *item, *next_item;
             item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
+            next_item = list_entry(q_next(current->q, cur_l), element_t, list);
             if (!descend && strcmp(item->value, next_item->value) > 0) {
                 report(1, "ERROR: Not sorted in ascending order");
                 ok = false;
@@ -668,7 +826,7 @@ bool do_sort(int argc, char *argv[])
                 !strcmp(item->value, next_item->value)) {
                 bool unstable = false;
                 for (unsigned i = 0; i < MAX_NODES; i++) {
-                    if (nodes[i] == cur_l->next) {
+                    if (nodes[i] == q_next(current->q, cur_l)) {
                         unstable = true;
                         break;
                     }
@@ -774,11 +932,15 @@ static bool do_ascend(int argc, char *argv[])
 
     cnt = current->size;
     if (current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --cnt; cur_l = cur_l->next) {
+        struct list_head *ahead =
+            q_prefetch_ahead(current->q, q_first(current->q));
+        for (struct list_head *cur_l = q_first(current->q);
+             cur_l != current->q && --cnt;
+             cur_l = q_next(current->q, cur_l),
+             ahead = q_prefetch_next(current->q, ahead)) {
             element_t *item, *next_item;
             item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
+            next_item = list_entry(q_next(current->q, cur_l), element_t, list);
             if (strcmp(item->value, next_item->value) > 0) {
                 report(1,
                        "ERROR: At least one node violated the ordering rule");
@@ -821,11 +983,15 @@ static bool do_descend(int argc, char *argv[])
 
     cnt = current->size;
     if (current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --cnt; cur_l = cur_l->next) {
+        struct list_head *ahead =
+            q_prefetch_ahead(current->q, q_first(current->q));
+        for (struct list_head *cur_l = q_first(current->q);
+             cur_l != current->q && --cnt;
+             cur_l = q_next(current->q, cur_l),
+             ahead = q_prefetch_next(current->q, ahead)) {
             element_t *item, *next_item;
             item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
+            next_item = list_entry(q_next(current->q, cur_l), element_t, list);
             if (strcmp(item->value, next_item->value) < 0) {
                 report(1,
                        "ERROR: At least one node violated the ordering rule");
@@ -868,7 +1034,6 @@ static bool do_reverseK(int argc, char *argv[])
     q_show(3);
     return !error_check();
 }
-void q_shuffle(struct list_head *head);
 static bool do_shuffle(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -882,15 +1047,377 @@ static bool do_shuffle(int argc, char *argv[])
     }
     error_check();
 
-    if (exception_setup(true)) {
-        q_shuffle(current->q);
-    }
+    bool ok = true;
+    if (exception_setup(true))
+        ok = q_shuffle(current->q);
     exception_cancel();
     set_noallocate_mode(false);
+    if (!ok)
+        report(1, "ERROR: Could not allocate space for shuffling");
     q_show(3);
+    return ok && !error_check();
+}
+
+/* Shuffle a queue of SHUFFLE_ITEMS distinct strings many times, count how
+ * often each of the SHUFFLE_ITEMS! orders comes up and compare the counts to
+ * a uniform distribution with Pearson's chi-square test.
+ */
+#define SHUFFLE_ITEMS 4
+#define SHUFFLE_ORDERS 24 /* SHUFFLE_ITEMS! */
+#define SHUFFLE_CRITICAL 35.172 /* chi-square, 23 degrees of freedom, 5% */
+
+static bool do_shufflecheck(int argc, char *argv[])
+{
+    int trials = 1000000;
+    if (argc > 2 || (argc == 2 && !get_int(argv[1], &trials)) || trials <= 0) {
+        report(1, "%s takes an optional positive number of shuffles", argv[0]);
+        return false;
+    }
+
+    struct list_head *q = q_new();
+    bool ok = q != NULL;
+    for (int i = 0; ok && i < SHUFFLE_ITEMS; i++) {
+        char s[2] = {'0' + i, '\0'};
+        ok = q_insert_tail(q, s);
+    }
+
+    long counts[SHUFFLE_ORDERS] = {0};
+    if (ok && exception_setup(true)) {
+        for (int t = 0; ok && t < trials; t++) {
+            ok = q_shuffle(q);
+
+            /* Rank the order through its Lehmer code */
+            int digit[SHUFFLE_ITEMS], n = 0, rank = 0;
+            element_t *e;
+            q_for_each_entry (e, q)
+                digit[n++] = e->value[0] - '0';
+            for (int i = 0; i < SHUFFLE_ITEMS; i++) {
+                int smaller = 0;
+                for (int j = i + 1; j < SHUFFLE_ITEMS; j++)
+                    smaller += digit[j] < digit[i];
+                rank = rank * (SHUFFLE_ITEMS - i) + smaller;
+            }
+            counts[rank]++;
+        }
+    }
+    exception_cancel();
+
+    while (q && !list_empty(q))
+        q_release_element(q_remove_head(q, NULL, 0));
+    q_free(q);
+
+    if (!ok) {
+        report(1, "ERROR: Could not set up or shuffle the test queue");
+        return false;
+    }
+
+    double expected = (double) trials / SHUFFLE_ORDERS, chi2 = 0;
+    for (int i = 0; i < SHUFFLE_ORDERS; i++) {
+        double d = counts[i] - expected;
+        chi2 += d * d / expected;
+    }
+    bool uniform = chi2 < SHUFFLE_CRITICAL;
+    /* A fair shuffle still fails one run in twenty */
+    report(1,
+           "Chi-square = %.3f over %d orders of %d strings, critical value "
+           "%.3f: %s",
+           chi2, SHUFFLE_ORDERS, SHUFFLE_ITEMS, SHUFFLE_CRITICAL,
+           uniform ? "consistent with uniform (p >= 0.05)"
+                   : "deviates from uniform (p < 0.05)");
+    return uniform && !error_check();
+}
+
+/* Throughput of the lock-free queue against a queue.h queue behind a single
+ * mutex. Each producer inserts items strings "producer seq" while as many
+ * consumers remove them; every consumer checks that the strings of each
+ * producer reach it in the order they were inserted.
+ */
+#define BENCH_MAX_THREADS 32
+
+struct lfq_bench {
+    int producers, items;
+    bool lockfree;
+    lfq_t *lfq;
+    struct list_head *q;
+    pthread_mutex_t lock;
+    atomic_long consumed;
+    atomic_bool failed;
+};
+
+struct lfq_bench_thread {
+    struct lfq_bench *b;
+    int id;
+};
+
+static void *lfq_bench_producer(void *arg)
+{
+    const struct lfq_bench_thread *t = arg;
+    struct lfq_bench *b = t->b;
+    char s[32];
+
+    for (int i = 0; i < b->items; i++) {
+        bool ok;
+        snprintf(s, sizeof(s), "%d %d", t->id, i);
+        if (b->lockfree) {
+            ok = lfq_insert_tail(b->lfq, s);
+        } else {
+            pthread_mutex_lock(&b->lock);
+            ok = q_insert_tail(b->q, s);
+            pthread_mutex_unlock(&b->lock);
+        }
+        if (!ok) {
+            atomic_store(&b->failed, true);
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *lfq_bench_consumer(void *arg)
+{
+    const struct lfq_bench_thread *t = arg;
+    struct lfq_bench *b = t->b;
+    long total = (long) b->producers * b->items;
+    int last[BENCH_MAX_THREADS];
+    char s[32];
+
+    for (int p = 0; p < b->producers; p++)
+        last[p] = -1;
+    while (atomic_load(&b->consumed) < total && !atomic_load(&b->failed)) {
+        element_t *e;
+        if (b->lockfree) {
+            e = lfq_remove_head(b->lfq, s, sizeof(s));
+            if (e)
+                lfq_release_element(e);
+        } else {
+            pthread_mutex_lock(&b->lock);
+            e = q_remove_head(b->q, s, sizeof(s));
+            if (e)
+                q_release_element(e);
+            pthread_mutex_unlock(&b->lock);
+        }
+        if (!e) {
+            sched_yield();
+            continue;
+        }
+        atomic_fetch_add(&b->consumed, 1);
+
+        char *end;
+        long p = strtol(s, &end, 10), i = strtol(end, NULL, 10);
+        if (p < 0 || p >= b->producers || i <= last[p]) {
+            atomic_store(&b->failed, true);
+            break;
+        }
+        last[p] = i;
+    }
+    return NULL;
+}
+
+/* Run one round with threads producers and as many consumers */
+static bool lfq_bench_run(struct lfq_bench *b, double *elapsed)
+{
+    pthread_t tid[2 * BENCH_MAX_THREADS];
+    struct lfq_bench_thread arg[2 * BENCH_MAX_THREADS];
+    int n = 0;
+    double start;
+
+    atomic_init(&b->consumed, 0);
+    atomic_init(&b->failed, false);
+    init_time(&start);
+    for (; n < 2 * b->producers; n++) {
+        arg[n].b = b;
+        arg[n].id = n % b->producers;
+        if (pthread_create(&tid[n], NULL,
+                           n < b->producers ? lfq_bench_producer
+                                            : lfq_bench_consumer,
+                           &arg[n])) {
+            atomic_store(&b->failed, true);
+            break;
+        }
+    }
+    while (n--)
+        pthread_join(tid[n], NULL);
+    *elapsed = delta_time(&start);
+    return !atomic_load(&b->failed);
+}
+
+static bool do_lfqbench(int argc, char *argv[])
+{
+    struct lfq_bench b = {.producers = 4, .items = 100000};
+    if (argc > 3 || (argc > 1 && !get_int(argv[1], &b.producers)) ||
+        (argc > 2 && !get_int(argv[2], &b.items)) || b.producers < 1 ||
+        b.producers > BENCH_MAX_THREADS || b.items < 1) {
+        report(1, "%s takes [producers (1-%d)] [items per producer]", argv[0],
+               BENCH_MAX_THREADS);
+        return false;
+    }
+
+    b.lfq = lfq_new();
+    b.q = q_new();
+    pthread_mutex_init(&b.lock, NULL);
+    bool ok = b.lfq && b.q;
+    double t[2] = {0, 0};
+    for (int i = 0; ok && i < 2; i++) {
+        b.lockfree = i;
+        ok = lfq_bench_run(&b, &t[i]);
+    }
+    pthread_mutex_destroy(&b.lock);
+    lfq_free(b.lfq);
+    while (b.q && !list_empty(b.q))
+        q_release_element(q_remove_head(b.q, NULL, 0));
+    q_free(b.q);
+
+    if (!ok) {
+        report(1, "ERROR: Benchmark failed to allocate, start threads or "
+                  "keep FIFO order");
+        return false;
+    }
+    double ops = 2.0 * b.producers * b.items;
+    report(1, "%d producers and %d consumers, %d items each", b.producers,
+           b.producers, b.items);
+    report(1, "  mutex-wrapped queue: %.3f s, %.2f M ops/s", t[0],
+           ops / t[0] / 1e6);
+    report(1, "  lock-free queue:     %.3f s, %.2f M ops/s", t[1],
+           ops / t[1] / 1e6);
     return !error_check();
 }
 
+static bool do_memstat(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+    if (!alloc_profiling)
+        report(1, "Profiling is off, turn it on with 'option profile 1'");
+    alloc_profile_report(false);
+    return true;
+}
+
+static bool do_walkbench(int argc, char *argv[])
+{
+    int rounds = 10;
+    if (argc > 2 || (argc == 2 && !get_int(argv[1], &rounds)) ||
+        rounds < 1) {
+        report(1, "%s takes [rounds]", argv[0]);
+        return false;
+    }
+    if (!current || !current->q || !current->size) {
+        report(1, "ERROR: No elements to walk over");
+        return false;
+    }
+
+    /* Both walks read the first byte of every string, as a check that looks
+     * at the elements would.
+     */
+    long sum[2] = {0, 0};
+    double elapsed[2];
+    for (int pf = 0; pf < 2; pf++) {
+        double start;
+        init_time(&start);
+        for (int r = 0; r < rounds; r++) {
+            element_t *e;
+            struct list_head *ahead;
+            if (pf) {
+                q_for_each_entry_prefetch (e, ahead, current->q)
+                    sum[pf] += e->value[0];
+            } else {
+                q_for_each_entry (e, current->q)
+                    sum[pf] += e->value[0];
+            }
+        }
+        elapsed[pf] = delta_time(&start);
+    }
+
+    long n = (long) rounds * current->size;
+    report(1, "%ld elements walked", n);
+    report(1, "  plain    %6.2f ns/element", elapsed[0] * 1e9 / n);
+    report(1, "  prefetch %6.2f ns/element (%d hops ahead)",
+           elapsed[1] * 1e9 / n, LIST_PREFETCH_HOPS);
+    if (sum[0] != sum[1]) {
+        report(1, "ERROR: Walks saw different elements");
+        return false;
+    }
+    return !error_check();
+}
+
+/* Bytes of strings each implementation gets to compare in cmpbench */
+#define CMPBENCH_BYTES (256 << 20)
+
+static bool do_cmpbench(int argc, char *argv[])
+{
+    int len = 16, pairs = 4096;
+    bool rand_len = argc > 1 && !strcmp(argv[1], "RAND");
+    if (argc > 3 || (argc > 1 && !rand_len && !get_int(argv[1], &len)) ||
+        (argc > 2 && !get_int(argv[2], &pairs)) || len < 0 ||
+        len > MAXSTRING || pairs < 1) {
+        report(1, "%s takes [length (0-%d) or RAND] [pairs]", argv[0],
+               MAXSTRING);
+        return false;
+    }
+
+    /* Pairs are packed back to back, so most strings start unaligned. Fixed
+     * length pairs agree up to their last byte, where every other pair
+     * differs; RAND pairs are independent strings like those of "ih RAND".
+     */
+    size_t stride = (rand_len ? MAX_RANDSTR_LEN : len) + 1;
+    char *buf = malloc(2 * stride * pairs);
+    if (!buf) {
+        report(1, "ERROR: Could not allocate benchmark strings");
+        return false;
+    }
+    for (int i = 0; i < pairs; i++) {
+        char *a = buf + 2 * stride * i, *b = a + stride;
+        if (rand_len) {
+            fill_rand_string(a, stride);
+            fill_rand_string(b, stride);
+            continue;
+        }
+        for (int j = 0; j < len; j++)
+            a[j] = charset[rand() % (sizeof(charset) - 1)];
+        a[len] = '\0';
+        memcpy(b, a, len + 1);
+        if (len && (i & 1))
+            b[len - 1] = b[len - 1] == 'a' ? 'b' : 'a';
+    }
+
+    long rounds = CMPBENCH_BYTES / (2 * stride * pairs) + 1;
+    if (rand_len)
+        report(1, "%ld compares of RAND strings", rounds * pairs);
+    else
+        report(1, "%ld compares of %d-byte strings", rounds * pairs, len);
+
+    const struct strcmp_impl *impl = strcmp_impls();
+    long expect = 0;
+    bool ok = true;
+    /* k == -1 is the C library's strcmp() */
+    for (int k = -1; k < 0 || impl[k].name; k++) {
+        strcmp_fn_t cmp = k < 0 ? strcmp : impl[k].cmp;
+        long less = 0;
+        double start;
+        init_time(&start);
+        for (long r = 0; r < rounds; r++) {
+            for (int i = 0; i < pairs; i++) {
+                const char *a = buf + 2 * stride * i;
+                less += cmp(a, a + stride) < 0;
+            }
+        }
+        double elapsed = delta_time(&start);
+        if (k < 0)
+            expect = less;
+        else if (less != expect)
+            ok = false;
+        report(1, "  %-8s %6.2f ns/compare%s", k < 0 ? "strcmp" : impl[k].name,
+               elapsed * 1e9 / (rounds * pairs),
+               k >= 0 && !impl[k + 1].name ? " (in use)" : "");
+    }
+    free(buf);
+
+    if (!ok)
+        report(1, "ERROR: Implementations disagree with strcmp()");
+    return ok && !error_check();
+}
+
 static bool do_merge(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -911,7 +1438,7 @@ static bool do_merge(int argc, char *argv[])
     exception_cancel();
     set_noallocate_mode(false);
 
-    if (q_size(&chain.head) > 1) {
+    if (chain.size > 1) {
         chain.size = 1;
         current = list_entry(chain.head.next, queue_contex_t, chain);
         current->size = len;
@@ -930,12 +1457,16 @@ static bool do_merge(int argc, char *argv[])
 
     bool ok = true;
     if (current && current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --len; cur_l = cur_l->next) {
+        struct list_head *ahead =
+            q_prefetch_ahead(current->q, q_first(current->q));
+        for (struct list_head *cur_l = q_first(current->q);
+             cur_l != current->q && --len;
+             cur_l = q_next(current->q, cur_l),
+             ahead = q_prefetch_next(current->q, ahead)) {
             /* Ensure each element in ascending order */
             element_t *item, *next_item;
             item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
+            next_item = list_entry(q_next(current->q, cur_l), element_t, list);
             if (!descend && strcmp(item->value, next_item->value) > 0) {
                 report(1,
                        "ERROR: Not sorted in ascending order (It might because "
@@ -1006,7 +1537,8 @@ static bool q_show(int vlevel)
     report_noreturn(vlevel, "l = [");
 
     struct list_head *ori = current->q;
-    struct list_head *cur = current->q->next;
+    struct list_head *cur = q_first(current->q);
+    struct list_head *ahead = q_prefetch_ahead(ori, cur);
 
     if (exception_setup(true)) {
         while (ok && ori != cur && cnt < current->size) {
@@ -1020,7 +1552,8 @@ static bool q_show(int vlevel)
                 }
             }
             cnt++;
-            cur = cur->next;
+            cur = q_next(ori, cur);
+            ahead = q_prefetch_next(ori, ahead);
             ok = ok && !error_check();
         }
     }
@@ -1055,6 +1588,20 @@ static bool do_show(int argc, char *argv[])
 
     if (current)
         report(1, "Current queue ID: %d", current->id);
+    if (current && current->q) {
+        /* Indexed by Q_ORDER_* flags; strict alone never occurs */
+        static const char *names[] = {
+            "unknown",
+            "ascending",
+            "descending",
+            "all equal",
+            "unknown",
+            "strictly ascending",
+            "strictly descending",
+            "trivial",
+        };
+        report(1, "Order: %s", names[q_order(current->q) & 7]);
+    }
 
     return q_show(0);
 }
@@ -1105,6 +1652,13 @@ static bool do_next(int argc, char *argv[])
     return q_show(0);
 }
 
+/* Restart the sort workers after 'option threads' */
+static void set_threads(int oldval)
+{
+    if (!q_sort_start_threads())
+        report(1, "Could only start %d sort threads", q_sort_threads);
+}
+
 static void console_init()
 {
     ADD_COMMAND(new, "Create new queue", "");
@@ -1119,10 +1673,11 @@ static void console_init()
                 "Insert string str at tail of queue n times. Generate random "
                 "string(s) if str equals RAND. (default: n == 1)",
                 "str [n]");
-    ADD_COMMAND(
-        rh,
-        "Remove from head of queue. Optionally compare to expected value str",
-        "[str]");
+    ADD_COMMAND(rh,
+                "Remove from head of queue n times. Optionally compare the "
+                "first one to expected value str, unless str equals RAND. "
+                "(default: n == 1)",
+                "[str [n]]");
     ADD_COMMAND(
         rt,
         "Remove from tail of queue. Optionally compare to expected value str",
@@ -1146,14 +1701,44 @@ static void console_init()
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
     ADD_COMMAND(shuffle, "shuffle the queue randomly", "");
+    ADD_COMMAND(lfqbench,
+                "Compare the lock-free queue with a mutex-wrapped queue",
+                "[producers] [items]");
+    ADD_COMMAND(cmpbench,
+                "Compare the string comparisons of the queue with strcmp()",
+                "[length|RAND] [pairs]");
+    ADD_COMMAND(memstat, "Show allocations by call site, size and command",
+                "");
+    ADD_COMMAND(walkbench,
+                "Time walking the queue with and without prefetching",
+                "[rounds]");
+    ADD_COMMAND(shufflecheck,
+                "Check that shuffle is uniform with a chi-square test",
+                "[shuffles]");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("compact", &compact_metadata,
+              "Keep block metadata in a side table instead of a header", NULL);
+    add_param("poison", &poison_interval,
+              "Poison and check one in N blocks (1: all, 0: none)", NULL);
+    add_param("profile", &alloc_profiling,
+              "Profile allocations, dumped on quit (see memstat)", NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("threads", &q_sort_threads,
+              "Number of threads sorting large queues", set_threads);
+    add_param("sorter", &q_sort_engine,
+              "Sort engine (0: bottom-up, 1: top-down, 2: adaptive merge, "
+              "3: radix)",
+              NULL);
+    add_param("intern", &q_intern,
+              "Share one copy of equal strings between elements", NULL);
+    add_param("timeout", &time_limit,
+              "Number of seconds a queue operation may take", NULL);
 }
 
 /* Signal handlers */
@@ -1186,8 +1771,6 @@ static void q_init()
 static bool q_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
 
     if (exception_setup(true)) {
         struct list_head *cur = chain.head.next;
@@ -1201,7 +1784,17 @@ static bool q_quit(int argc, char *argv[])
     }
 
     exception_cancel();
-    set_cautious_mode(true);
+
+    q_sort_threads = 1;
+    q_sort_start_threads();
+
+    free(remove_buf);
+    remove_buf = NULL;
+    remove_buf_length = -1;
+
+    /* Blocks still live at any call site are leaks */
+    if (alloc_profiling)
+        alloc_profile_report(true);
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -1418,33 +2011,6 @@ uintptr_t os_random(uintptr_t seed)
     return x;
 }
 
-void q_shuffle(struct list_head *head)
-{
-    if (!head || list_empty(head) || list_is_singular(head))
-        return;
-    int i = q_size(head);
-    int len = i;
-    struct list_head *j_pos = head;
-    struct list_head *i_pos = head->prev;
-    for (int cnt = 1; cnt < len; cnt++) {
-        int j = rand() % i;
-        for (int m = 0; m < j; m++) {
-            j_pos = j_pos->next;
-        }
-        struct list_head *j_prev = j_pos->prev;
-        struct list_head *i_prev = i_pos->prev;
-        if (i_prev == j_pos) {
-            list_move(j_pos, i_pos);
-        } else {
-            list_move(i_pos, j_pos);
-            list_move(j_pos, j_prev);
-        }
-        i = i - 1;
-        j_pos = head;
-        i_pos = i_pos->prev;
-    }
-}
-
 #define BUFSIZE 256
 int main(int argc, char *argv[])
 {
@@ -1482,7 +2048,7 @@ int main(int argc, char *argv[])
         }
         case 'l':
             strncpy(lbuf, optarg, BUFSIZE);
-            buf[BUFSIZE - 1] = '\0';
+            lbuf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
         default:
@@ -1518,6 +2084,12 @@ int main(int argc, char *argv[])
 
     add_quit_helper(q_quit);
 
+#ifdef NO_HARNESS
+    report(1,
+           "Built without the test harness: allocations are neither checked "
+           "nor counted, and malloc never fails");
+#endif
+
     bool ok = true;
     ok = ok && run_console(infile_name);
 
@@ -1,8 +1,13 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "queue.h"
+#include "random.h"
+#include "simd_strcmp.h"
 
 /* Notice: sometimes, Cppcheck would find the potential NULL pointer bugs,
  * but some of them cannot occur. You can suppress them by adding the
@@ -10,321 +15,2598 @@
  *   cppcheck-suppress nullPointer
  */
 
-/* Create an empty queue */
-struct list_head *q_new()
+/* Elements are carved out of per-queue slab chunks, so that q_free() only
+ * has to release a handful of chunks instead of every node, and nodes given
+ * back by q_release_element() are recycled by later insertions. Element sizes
+ * are rounded up to SLAB_GRAIN bytes; anything larger than SLAB_MAX_OBJECT
+ * gets a chunk of its own.
+ */
+#define SLAB_CHUNK_SIZE (64 * 1024)
+#define SLAB_GRAIN 16
+#define SLAB_MAX_OBJECT 256
+#define SLAB_CLASSES (SLAB_MAX_OBJECT / SLAB_GRAIN)
+
+typedef struct slab slab_t;
+
+struct slab_chunk {
+    struct list_head list; /* linked into slab_t.chunks */
+    slab_t *slab;          /* owner, updated when queues are merged */
+};
+
+struct slab {
+    struct list_head chunks;
+    struct slab_chunk *current; /* chunk the bump region belongs to */
+    char *cursor, *limit;
+    struct list_head *free[SLAB_CLASSES]; /* recycled nodes, via list.next */
+};
+
+/* Queue header handed out by q_new() as &q->head. Every operation that links
+ * or unlinks elements keeps size up to date, which makes q_size() O(1).
+ *
+ * q_reverse() only toggles reversed. While it is set the queue reads from
+ * head.prev to head.next: insertions and removals trade ends, and operations
+ * that depend on the direction either mirror themselves or call
+ * queue_settle() to put the nodes in their actual order first. Any index kept
+ * by a backend follows the nodes, not the logical order.
+ *
+ * order holds the Q_ORDER_* flags known to hold for the nodes, read from
+ * head.next, and q_order() translates them for a reversed queue. Insertions
+ * compare the new element with its neighbour to keep them up to date; taking
+ * elements out never breaks an order, and rearranging the nodes clears it.
+ * A queue with less than two elements is in every order.
+ */
+typedef struct {
+    struct list_head head; /* must stay first */
+    int size;
+    bool reversed;
+    unsigned char order;
+    slab_t slab;
+#ifdef QUEUE_UNROLLED
+    struct list_head chunks; /* index of the elements, see below */
+    struct list_head spare;  /* index chunks not in use */
+    int nspare;
+    slab_t ixslab; /* where index chunks come from */
+#elif defined(QUEUE_RING)
+    element_t **ring; /* size elements from ring[rhead], see below */
+    unsigned rhead, rcap;
+    bool rvalid;
+#endif
+} queue_t;
+
+/* Orders of a queue with less than two elements */
+#define Q_ORDER_ANY (Q_ORDER_ASCEND | Q_ORDER_DESCEND | Q_ORDER_STRICT)
+
+static inline queue_t *queue_of(struct list_head *head)
 {
-    struct list_head *head = malloc(sizeof(struct list_head));
-    if (!head)
+    return list_entry(head, queue_t, head);
+}
+
+/* Bytes taken by an element, including its payload if it is inline */
+static inline size_t element_size(const element_t *e)
+{
+    return sizeof(element_t) + (e->value == e->data ? strlen(e->data) + 1 : 0);
+}
+
+static inline size_t slab_class(size_t size)
+{
+    return (size + SLAB_GRAIN - 1) / SLAB_GRAIN - 1;
+}
+
+static void slab_init(slab_t *slab)
+{
+    INIT_LIST_HEAD(&slab->chunks);
+    slab->current = NULL;
+    slab->cursor = slab->limit = NULL;
+    memset(slab->free, 0, sizeof(slab->free));
+}
+
+/* Start a fresh bump region; whatever was left of the old one is dropped */
+static bool slab_grow(slab_t *slab)
+{
+    struct slab_chunk *chunk = malloc(SLAB_CHUNK_SIZE);
+    if (!chunk)
+        return false;
+    chunk->slab = slab;
+    list_add(&chunk->list, &slab->chunks);
+    slab->current = chunk;
+    slab->cursor = (char *) (chunk + 1);
+    slab->limit = (char *) chunk + SLAB_CHUNK_SIZE;
+    return true;
+}
+
+static element_t *slab_alloc(slab_t *slab, size_t size)
+{
+    element_t *e;
+
+    if (size > SLAB_MAX_OBJECT) {
+        struct slab_chunk *chunk = malloc(sizeof(struct slab_chunk) + size);
+        if (!chunk)
+            return NULL;
+        chunk->slab = slab;
+        list_add_tail(&chunk->list, &slab->chunks);
+        e = (element_t *) (chunk + 1);
+        e->chunk = chunk;
+        return e;
+    }
+
+    size_t cls = slab_class(size);
+    struct list_head *node = slab->free[cls];
+    if (node) {
+        slab->free[cls] = node->next;
+        return list_entry(node, element_t, list);
+    }
+
+    size = (cls + 1) * SLAB_GRAIN;
+    if ((size_t) (slab->limit - slab->cursor) < size && !slab_grow(slab))
         return NULL;
-    INIT_LIST_HEAD(head);
-    return head;
+    e = (element_t *) slab->cursor;
+    slab->cursor += size;
+    e->chunk = slab->current;
+    return e;
 }
 
-/* Free all storage used by queue */
-void q_free(struct list_head *head)
+static void slab_free(slab_t *slab, element_t *e)
 {
-    if (!head)
+    size_t size = element_size(e);
+    if (size > SLAB_MAX_OBJECT) {
+        list_del(&e->chunk->list);
+        free(e->chunk);
         return;
-    struct list_head *pos, *safe;
-    list_for_each_safe (pos, safe, head) {
-        element_t *node = list_entry(pos, element_t, list);
-        list_del(pos);
-        q_release_element(node);
     }
-    free(head);
+
+    size_t cls = slab_class(size);
+    e->list.next = slab->free[cls];
+    slab->free[cls] = &e->list;
 }
 
-/* Insert an element at head of queue */
-bool q_insert_head(struct list_head *head, char *s)
+/* Hand every chunk of src over to dst, leaving src empty. Free slots and the
+ * bump region of src are dropped; they are reclaimed along with dst.
+ */
+static void slab_merge(slab_t *dst, slab_t *src)
 {
-    if (!head || !s)
-        return false;
-    element_t *node = malloc(sizeof(element_t));
-    if (!node)
-        return false;
-    node->value = strdup(s);
-    if (!node->value) {
-        free(node);
+    struct slab_chunk *chunk;
+    list_for_each_entry (chunk, &src->chunks, list)
+        chunk->slab = dst;
+    list_splice_tail(&src->chunks, &dst->chunks);
+    slab_init(src);
+}
+
+static void slab_destroy(slab_t *slab)
+{
+    struct list_head *pos, *safe;
+    list_for_each_safe (pos, safe, &slab->chunks)
+        free(list_entry(pos, struct slab_chunk, list));
+    slab_init(slab);
+}
+
+/* Interned strings, used while q_intern is set.
+ *
+ * Each distinct string is stored once, in an entry of a hash table shared by
+ * all queues, and elements point their value at it instead of carrying a
+ * copy. Entries count their elements and are freed with the last one. The
+ * table doubles once it holds as many entries as it has buckets, and goes
+ * away together with its last entry, so that an idle program holds no
+ * memory for it.
+ */
+#define INTERN_MIN_BUCKETS 64
+
+struct intern {
+    struct intern *next; /* in the same bucket */
+    uint32_t hash;
+    uint32_t refs;
+    char str[];
+};
+
+static struct {
+    struct intern **bucket;
+    size_t mask; /* number of buckets minus one */
+    size_t count;
+} interned;
+
+int q_intern = 0;
+
+static inline struct intern *intern_of(const char *str)
+{
+    return (struct intern *) (str - offsetof(struct intern, str));
+}
+
+/* FNV-1a */
+static uint32_t intern_hash(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char) s[i]) * 16777619u;
+    return h;
+}
+
+/* Move every entry into a table of nbucket buckets */
+static bool intern_resize(size_t nbucket)
+{
+    struct intern **bucket = calloc(nbucket, sizeof(*bucket));
+    if (!bucket)
         return false;
+    for (size_t i = 0; interned.bucket && i <= interned.mask; i++) {
+        struct intern *it = interned.bucket[i], *next;
+        for (; it; it = next) {
+            next = it->next;
+            it->next = bucket[it->hash & (nbucket - 1)];
+            bucket[it->hash & (nbucket - 1)] = it;
+        }
+    }
+    free(interned.bucket);
+    interned.bucket = bucket;
+    interned.mask = nbucket - 1;
+    return true;
+}
+
+/* Interned copy of the string s of length len, NULL if out of memory */
+static char *intern_get(const char *s, size_t len)
+{
+    uint32_t hash = intern_hash(s, len);
+    if (interned.bucket) {
+        struct intern *it = interned.bucket[hash & interned.mask];
+        for (; it; it = it->next) {
+            if (it->hash == hash && !memcmp(it->str, s, len + 1)) {
+                it->refs++;
+                return it->str;
+            }
+        }
+    }
+
+    if (!interned.bucket || interned.count > interned.mask) {
+        size_t nbucket =
+            interned.bucket ? (interned.mask + 1) * 2 : INTERN_MIN_BUCKETS;
+        /* A table that cannot grow still works, only slower */
+        if (!intern_resize(nbucket) && !interned.bucket)
+            return NULL;
+    }
+    struct intern *it = malloc(sizeof(struct intern) + len + 1);
+    if (!it) {
+        if (!interned.count) {
+            free(interned.bucket);
+            interned.bucket = NULL;
+        }
+        return NULL;
+    }
+    memcpy(it->str, s, len + 1);
+    it->hash = hash;
+    it->refs = 1;
+    it->next = interned.bucket[hash & interned.mask];
+    interned.bucket[hash & interned.mask] = it;
+    interned.count++;
+    return it->str;
+}
+
+/* Drop a reference to an interned string */
+static void intern_put(const char *str)
+{
+    struct intern *it = intern_of(str);
+    if (--it->refs)
+        return;
+
+    struct intern **pp = &interned.bucket[it->hash & interned.mask];
+    while (*pp != it)
+        pp = &(*pp)->next;
+    *pp = it->next;
+    free(it);
+    if (!--interned.count) {
+        free(interned.bucket);
+        interned.bucket = NULL;
+    }
+}
+
+#ifdef QUEUE_UNROLLED
+/* Unrolled backend.
+ *
+ * Following one list_head per element turns every walk over a queue into a
+ * chain of dependent cache misses. With BACKEND=unrolled the queue also keeps
+ * an index: the element pointers in queue order, each next to a copy of the
+ * element key, UCHUNK_SLOTS to a chunk of two cache lines. Walking the index
+ * costs one miss per chunk, and the elements it points at can be fetched
+ * independently of each other. The list stays valid at all times, so code
+ * walking it directly keeps working.
+ *
+ * Insertions and removals at either end update the index in O(1). Operations
+ * that edit the middle of the list rebuild it afterwards in one pass, while
+ * q_delete_mid(), q_reverse() and q_sort() work on the index and relink the
+ * list from it. Chunks come from a slab of their own, which keeps them close
+ * together and the elements as dense as without the index, and are recycled
+ * through the spare list; UCHUNK_RESERVE of them are held back for q_sort(),
+ * which must not allocate.
+ */
+#define UCHUNK_SLOTS 6
+#define UCHUNK_RESERVE 4
+
+struct ix_slot {
+    uint64_t key; /* copy of e->key */
+    element_t *e;
+};
+
+struct uchunk {
+    struct list_head list;
+    unsigned char lo, hi; /* slot[lo..hi) is in use */
+    struct ix_slot slot[UCHUNK_SLOTS];
+};
+
+static void ix_put(queue_t *q, struct uchunk *c)
+{
+    list_add(&c->list, &q->spare);
+    q->nspare++;
+}
+
+/* A chunk from the spare list, or a fresh one. Growing the index leaves the
+ * reserve alone.
+ */
+static struct uchunk *ix_get(queue_t *q, bool grow)
+{
+    if (list_empty(&q->spare) || (grow && q->nspare <= UCHUNK_RESERVE))
+        return (struct uchunk *) slab_alloc(&q->ixslab, sizeof(struct uchunk));
+    struct uchunk *c = list_first_entry(&q->spare, struct uchunk, list);
+    list_del(&c->list);
+    q->nspare--;
+    return c;
+}
+
+static bool ix_init(queue_t *q)
+{
+    INIT_LIST_HEAD(&q->chunks);
+    INIT_LIST_HEAD(&q->spare);
+    q->nspare = 0;
+    slab_init(&q->ixslab);
+    for (int i = 0; i < UCHUNK_RESERVE; i++) {
+        struct uchunk *c = ix_get(q, true);
+        if (!c)
+            return false;
+        ix_put(q, c);
     }
+    return true;
+}
 
-    list_add(&node->list, head);
+static void ix_destroy(queue_t *q)
+{
+    slab_destroy(&q->ixslab);
+}
+
+/* Put enough chunks on the spare list for n more pushes at one end */
+static bool ix_reserve(queue_t *q, int n)
+{
+    int need = UCHUNK_RESERVE + n / UCHUNK_SLOTS + 1;
+    while (q->nspare < need) {
+        struct uchunk *c =
+            (struct uchunk *) slab_alloc(&q->ixslab, sizeof(struct uchunk));
+        if (!c)
+            return false;
+        ix_put(q, c);
+    }
     return true;
 }
 
-/* Insert an element at tail of queue */
-bool q_insert_tail(struct list_head *head, char *s)
+static bool ix_push_head(queue_t *q, element_t *e)
 {
-    if (!head || !s)
+    struct uchunk *c = list_first_entry(&q->chunks, struct uchunk, list);
+    if (list_empty(&q->chunks) || c->lo == 0) {
+        if (!(c = ix_get(q, true)))
+            return false;
+        c->lo = c->hi = UCHUNK_SLOTS;
+        list_add(&c->list, &q->chunks);
+    }
+    c->slot[--c->lo] = (struct ix_slot){e->key, e};
+    return true;
+}
+
+static bool ix_push_tail(queue_t *q, element_t *e)
+{
+    struct uchunk *c = list_last_entry(&q->chunks, struct uchunk, list);
+    if (list_empty(&q->chunks) || c->hi == UCHUNK_SLOTS) {
+        if (!(c = ix_get(q, true)))
+            return false;
+        c->lo = c->hi = 0;
+        list_add_tail(&c->list, &q->chunks);
+    }
+    c->slot[c->hi++] = (struct ix_slot){e->key, e};
+    return true;
+}
+
+static void ix_pop_head(queue_t *q)
+{
+    struct uchunk *c = list_first_entry(&q->chunks, struct uchunk, list);
+    if (++c->lo == c->hi) {
+        list_del(&c->list);
+        ix_put(q, c);
+    }
+}
+
+static void ix_pop_tail(queue_t *q)
+{
+    struct uchunk *c = list_last_entry(&q->chunks, struct uchunk, list);
+    if (--c->hi == c->lo) {
+        list_del(&c->list);
+        ix_put(q, c);
+    }
+}
+
+/* Link the list in index order */
+static void ix_relink(queue_t *q)
+{
+    struct list_head *prev = &q->head;
+    struct uchunk *c;
+    list_for_each_entry (c, &q->chunks, list) {
+        for (unsigned i = c->lo; i < c->hi; i++) {
+            struct list_head *node = &c->slot[i].e->list;
+            prev->next = node;
+            node->prev = prev;
+            prev = node;
+        }
+    }
+    prev->next = &q->head;
+    q->head.prev = prev;
+}
+
+/* Index the list afresh after it was edited in the middle. The packed index
+ * never needs more chunks than the old one had, so this does not allocate.
+ */
+static void ix_rebuild(queue_t *q)
+{
+    struct uchunk *c, *safe;
+    list_for_each_entry_safe (c, safe, &q->chunks, list)
+        ix_put(q, c);
+    INIT_LIST_HEAD(&q->chunks);
+
+    element_t *e;
+    struct list_head *ahead;
+    c = NULL;
+    list_for_each_entry_prefetch (e, ahead, &q->head, list) {
+        if (!c || c->hi == UCHUNK_SLOTS) {
+            c = ix_get(q, false);
+            c->lo = c->hi = 0;
+            list_add_tail(&c->list, &q->chunks);
+        }
+        c->slot[c->hi++] = (struct ix_slot){e->key, e};
+    }
+}
+
+/* Hand the index chunks of src over to dst */
+static void ix_merge_into(queue_t *dst, queue_t *src)
+{
+    struct uchunk *c, *safe;
+    list_for_each_entry_safe (c, safe, &src->chunks, list)
+        ix_put(dst, c);
+    list_for_each_entry_safe (c, safe, &src->spare, list)
+        ix_put(dst, c);
+    INIT_LIST_HEAD(&src->chunks);
+    INIT_LIST_HEAD(&src->spare);
+    src->nspare = 0;
+    slab_merge(&dst->ixslab, &src->ixslab);
+}
+
+/* Unlink the element at position pos of the index and return it, NULL if
+ * the list has to be walked instead
+ */
+static element_t *ix_take(queue_t *q, int pos)
+{
+    struct uchunk *c;
+    list_for_each_entry (c, &q->chunks, list) {
+        if (pos < c->hi - c->lo)
+            break;
+        pos -= c->hi - c->lo;
+    }
+    unsigned i = c->lo + pos;
+    element_t *e = c->slot[i].e;
+    memmove(&c->slot[i], &c->slot[i + 1],
+            (c->hi - i - 1) * sizeof(c->slot[0]));
+    if (--c->hi == c->lo) {
+        list_del(&c->list);
+        ix_put(q, c);
+    }
+    list_del(&e->list);
+    return e;
+}
+
+/* Reverse the index, then the list along with it. Returns false if the list
+ * has to be reversed on its own.
+ */
+static bool ix_reverse(queue_t *q)
+{
+    struct list_head *pos, *safe;
+    list_for_each_safe (pos, safe, &q->chunks) {
+        struct uchunk *c = list_entry(pos, struct uchunk, list);
+        for (unsigned i = c->lo, j = c->hi - 1; i < j; i++, j--) {
+            struct ix_slot tmp = c->slot[i];
+            c->slot[i] = c->slot[j];
+            c->slot[j] = tmp;
+        }
+        pos->next = pos->prev;
+        pos->prev = safe;
+    }
+    pos = q->chunks.next;
+    q->chunks.next = q->chunks.prev;
+    q->chunks.prev = pos;
+    ix_relink(q);
+    return true;
+}
+#elif defined(QUEUE_RING)
+/* Ring backend.
+ *
+ * With BACKEND=ring the queue also keeps its element pointers in a ring
+ * buffer: a power-of-two array indexed from rhead modulo its capacity, so
+ * the i-th element is found in O(1). The list stays valid at all times, so
+ * code walking it directly keeps working.
+ *
+ * Pushing and popping at either end stay O(1), but a push into a full ring
+ * copies it into one of twice the size, which is O(n) once every n pushes.
+ * q_delete_mid() finds its element directly but shifts the shorter half of
+ * the ring to close the gap, where the list just unlinks a node. Swap,
+ * reverseK, dedup, ascend/descend and shuffle re-index the ring in one pass
+ * afterwards. So does q_merge(), whose splice turns from O(1) into O(n).
+ * q_reverse() and q_sort() work on the ring and relink the list from it.
+ * As q_merge() may not allocate, a ring too small for the merged queue is
+ * dropped instead (rvalid is cleared) and rebuilt by the next insertion;
+ * until then the list is used on its own.
+ */
+#define RING_MIN 16
+
+static inline element_t **ring_at(queue_t *q, unsigned i)
+{
+    return &q->ring[(q->rhead + i) & (q->rcap - 1)];
+}
+
+static bool ix_init(queue_t *q)
+{
+    q->ring = NULL;
+    q->rhead = q->rcap = 0;
+    q->rvalid = true;
+    return true;
+}
+
+static void ix_destroy(queue_t *q)
+{
+    free(q->ring);
+}
+
+/* Index the list afresh if the ring has room for it, drop the ring if not */
+static void ix_rebuild(queue_t *q)
+{
+    q->rvalid = (unsigned) q->size <= q->rcap;
+    if (!q->rvalid)
+        return;
+    element_t *e;
+    struct list_head *ahead;
+    unsigned i = 0;
+    q->rhead = 0;
+    list_for_each_entry_prefetch (e, ahead, &q->head, list)
+        q->ring[i++] = e;
+}
+
+/* Make room for extra more elements, reallocating the ring if it is short */
+static bool ring_reserve(queue_t *q, unsigned extra)
+{
+    unsigned n = q->size + extra;
+    if (!q->rvalid)
+        ix_rebuild(q); /* the queue may fit again */
+    if (q->rvalid && n <= q->rcap)
+        return true;
+
+    unsigned cap = q->rcap ? q->rcap : RING_MIN;
+    while (cap < n)
+        cap <<= 1;
+    element_t **ring = malloc(cap * sizeof(*ring));
+    if (!ring)
         return false;
-    element_t *node = malloc(sizeof(element_t));
-    if (!node)
+    bool copy = q->rvalid;
+    if (copy) {
+        for (unsigned i = 0; i < (unsigned) q->size; i++)
+            ring[i] = *ring_at(q, i);
+    }
+    free(q->ring);
+    q->ring = ring;
+    q->rcap = cap;
+    q->rhead = 0;
+    if (!copy)
+        ix_rebuild(q);
+    return true;
+}
+
+static bool ix_reserve(queue_t *q, int n)
+{
+    return ring_reserve(q, n);
+}
+
+static bool ix_push_head(queue_t *q, element_t *e)
+{
+    if (!ring_reserve(q, 1))
         return false;
-    node->value = strdup(s);
-    if (!node->value) {
-        free(node);
+    q->rhead = (q->rhead - 1) & (q->rcap - 1);
+    q->ring[q->rhead] = e;
+    return true;
+}
+
+static bool ix_push_tail(queue_t *q, element_t *e)
+{
+    if (!ring_reserve(q, 1))
+        return false;
+    *ring_at(q, q->size) = e;
+    return true;
+}
+
+/* The ring holds q->size elements, which the callers update */
+static void ix_pop_head(queue_t *q)
+{
+    if (q->rvalid)
+        q->rhead = (q->rhead + 1) & (q->rcap - 1);
+}
+
+static inline void ix_pop_tail(queue_t *q) {}
+
+/* Leave src with an empty ring; its buffer is freed along with it */
+static void ix_merge_into(queue_t *dst, queue_t *src)
+{
+    src->rhead = 0;
+    src->rvalid = true;
+}
+
+static element_t *ix_take(queue_t *q, int pos)
+{
+    if (!q->rvalid)
+        return NULL;
+    unsigned n = q->size;
+    element_t *e = *ring_at(q, pos);
+    if ((unsigned) pos < n / 2) {
+        for (unsigned i = pos; i > 0; i--)
+            *ring_at(q, i) = *ring_at(q, i - 1);
+        q->rhead = (q->rhead + 1) & (q->rcap - 1);
+    } else {
+        for (unsigned i = pos; i + 1 < n; i++)
+            *ring_at(q, i) = *ring_at(q, i + 1);
+    }
+    list_del(&e->list);
+    return e;
+}
+
+/* Link the list in ring order */
+static void ring_relink(queue_t *q)
+{
+    struct list_head *prev = &q->head;
+    for (unsigned i = 0; i < (unsigned) q->size; i++) {
+        struct list_head *node = &(*ring_at(q, i))->list;
+        prev->next = node;
+        node->prev = prev;
+        prev = node;
+    }
+    prev->next = &q->head;
+    q->head.prev = prev;
+}
+
+static bool ix_reverse(queue_t *q)
+{
+    if (!q->rvalid)
         return false;
+    unsigned n = q->size;
+    for (unsigned i = 0, j = n - 1; i < j; i++, j--) {
+        element_t *tmp = *ring_at(q, i);
+        *ring_at(q, i) = *ring_at(q, j);
+        *ring_at(q, j) = tmp;
     }
-    list_add_tail(&node->list, head);
+    ring_relink(q);
+    return true;
+}
+#else
+static inline bool ix_init(queue_t *q)
+{
     return true;
 }
 
-/* Remove an element from head of queue */
-element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+static inline void ix_destroy(queue_t *q) {}
+
+static inline bool ix_reserve(queue_t *q, int n)
 {
-    if (!head || list_empty(head))
+    return true;
+}
+
+static inline bool ix_push_head(queue_t *q, element_t *e)
+{
+    return true;
+}
+
+static inline bool ix_push_tail(queue_t *q, element_t *e)
+{
+    return true;
+}
+
+static inline void ix_pop_head(queue_t *q) {}
+static inline void ix_pop_tail(queue_t *q) {}
+static inline void ix_rebuild(queue_t *q) {}
+static inline void ix_merge_into(queue_t *dst, queue_t *src) {}
+static inline element_t *ix_take(queue_t *q, int pos)
+{
+    return NULL;
+}
+static inline bool ix_reverse(queue_t *q)
+{
+    return false;
+}
+#endif
+
+/* Create an empty queue */
+struct list_head *q_new()
+{
+    queue_t *q = malloc(sizeof(queue_t));
+    if (!q)
         return NULL;
-    element_t *node = list_entry(head->next, element_t, list);
-    list_del(head->next);
-    if (sp && bufsize > 0 && node->value) {
-        strncpy(sp, node->value, bufsize - 1);
-        sp[bufsize - 1] = '\0';
+    INIT_LIST_HEAD(&q->head);
+    q->size = 0;
+    q->reversed = false;
+    q->order = Q_ORDER_ANY;
+    slab_init(&q->slab);
+    /* Set up the first chunk now so that early insertions do not pay for it.
+     * Failing here is harmless; the chunk is then allocated on demand.
+     */
+    slab_grow(&q->slab);
+    if (!ix_init(q)) {
+        ix_destroy(q);
+        slab_destroy(&q->slab);
+        free(q);
+        return NULL;
+    }
+    return &q->head;
+}
+
+/* Free all storage used by queue */
+void q_free(struct list_head *head)
+{
+    if (!head)
+        return;
+    queue_t *q = queue_of(head);
+    /* Chunks go back whole, but interned strings need their count dropped */
+    if (interned.count) {
+        element_t *e;
+        struct list_head *ahead;
+        q_for_each_entry_prefetch (e, ahead, head) {
+            if (e->value != e->data)
+                intern_put(e->value);
+        }
+    }
+    ix_destroy(q);
+    slab_destroy(&q->slab);
+    free(q);
+}
+
+/* Return an element to the slab it was carved from */
+void q_release_element(element_t *e)
+{
+    if (e->value != e->data)
+        intern_put(e->value);
+    if (!e->chunk) {
+        free(e);
+        return;
+    }
+    slab_free(e->chunk->slab, e);
+}
+
+/* strcmp() on two elements, settled by their keys whenever they differ or
+ * the strings end inside the key, which shows as a zero last key byte.
+ */
+static inline int element_cmp(const element_t *a, const element_t *b)
+{
+    if (a->key != b->key)
+        return a->key < b->key ? -1 : 1;
+    if (!(a->key & 0xff))
+        return 0;
+    return simd_strcmp(a->value + ELEMENT_KEY_BYTES,
+                       b->value + ELEMENT_KEY_BYTES);
+}
+
+/* Whether two elements hold equal strings. Interned strings are only ever
+ * equal to themselves.
+ */
+static inline bool element_eq(const element_t *a, const element_t *b)
+{
+    if (a->value != a->data && b->value != b->data)
+        return a->value == b->value;
+    return !element_cmp(a, b);
+}
+
+/* The same orders, for the nodes read the other way round */
+static inline unsigned order_flip(unsigned order)
+{
+    return (order & Q_ORDER_STRICT) |
+           (order & Q_ORDER_ASCEND ? Q_ORDER_DESCEND : 0) |
+           (order & Q_ORDER_DESCEND ? Q_ORDER_ASCEND : 0);
+}
+
+/* Keep the orders of q which survive a placed right before b */
+static void order_link(queue_t *q, const element_t *a, const element_t *b)
+{
+    if (!q->order)
+        return;
+    int r = element_cmp(a, b);
+    if (r < 0)
+        q->order &= Q_ORDER_ASCEND | Q_ORDER_STRICT;
+    else if (r > 0)
+        q->order &= Q_ORDER_DESCEND | Q_ORDER_STRICT;
+    else
+        q->order &= Q_ORDER_ASCEND | Q_ORDER_DESCEND;
+    if (!(q->order & (Q_ORDER_ASCEND | Q_ORDER_DESCEND)))
+        q->order = 0;
+}
+
+/* After elements were taken out of q */
+static inline void order_unlinked(queue_t *q)
+{
+    if (q->size < 2)
+        q->order = Q_ORDER_ANY;
+}
+
+/* After the nodes of q were rearranged: only equal elements stay in order */
+static inline void order_permuted(queue_t *q)
+{
+    if ((q->order & (Q_ORDER_ASCEND | Q_ORDER_DESCEND)) !=
+        (Q_ORDER_ASCEND | Q_ORDER_DESCEND))
+        q->order = 0;
+}
+
+/* Allocate an element with its string stored inline behind the node, or
+ * pointing at the interned string if q_intern is set
+ */
+static element_t *q_new_element(struct list_head *head, const char *s)
+{
+    size_t len = strlen(s);
+    slab_t *slab = &queue_of(head)->slab;
+    element_t *node;
+
+    if (q_intern) {
+        char *str = intern_get(s, len);
+        if (!str)
+            return NULL;
+        node = slab_alloc(slab, sizeof(element_t));
+        if (!node) {
+            intern_put(str);
+            return NULL;
+        }
+        node->value = str;
+    } else {
+        node = slab_alloc(slab, sizeof(element_t) + len + 1);
+        if (!node)
+            return NULL;
+        memcpy(node->data, s, len + 1);
+        node->value = node->data;
+    }
+    node->key = element_key(s, len);
+    return node;
+}
+
+/* Link a new element at the head or the tail of the nodes */
+static bool q_insert(struct list_head *head, char *s, bool tail)
+{
+    if (!head || !s)
+        return false;
+    element_t *node = q_new_element(head, s);
+    if (!node)
+        return false;
+    queue_t *q = queue_of(head);
+    if (!(tail ? ix_push_tail(q, node) : ix_push_head(q, node))) {
+        q_release_element(node);
+        return false;
+    }
+    if (tail) {
+        if (!list_empty(head))
+            order_link(q, list_last_entry(head, element_t, list), node);
+        list_add_tail(&node->list, head);
+    } else {
+        if (!list_empty(head))
+            order_link(q, node, list_first_entry(head, element_t, list));
+        list_add(&node->list, head);
+    }
+    q->size++;
+    return true;
+}
+
+/* Insert an element at head of queue */
+bool q_insert_head(struct list_head *head, char *s)
+{
+    return q_insert(head, s, q_reversed(head));
+}
+
+/* Insert an element at tail of queue */
+bool q_insert_tail(struct list_head *head, char *s)
+{
+    return q_insert(head, s, !q_reversed(head));
+}
+
+/* Link n new elements at the head or the tail of the nodes, ending up as n
+ * calls to q_insert() would leave them. The elements and the room in the
+ * index are all allocated first, so that either every string goes in or none
+ * does, and the elements are then spliced in as one chain.
+ */
+static bool q_insert_bulk(struct list_head *head, char **s, int n, bool tail)
+{
+    if (!head || !s || n < 0)
+        return false;
+    queue_t *q = queue_of(head);
+    LIST_HEAD(chain);
+    int i;
+    for (i = 0; i < n; i++) {
+        element_t *node = s[i] ? q_new_element(head, s[i]) : NULL;
+        if (!node)
+            break;
+        if (tail)
+            list_add_tail(&node->list, &chain);
+        else
+            list_add(&node->list, &chain);
+    }
+    if (i < n || !ix_reserve(q, n)) {
+        element_t *node, *safe;
+        list_for_each_entry_safe (node, safe, &chain, list)
+            q_release_element(node);
+        return false;
+    }
+    if (!n)
+        return true;
+
+    /* Orders hold if they hold along the chain and where it meets the queue */
+    element_t *first = list_first_entry(&chain, element_t, list);
+    element_t *last = list_last_entry(&chain, element_t, list);
+    if (!list_empty(head)) {
+        if (tail)
+            order_link(q, list_last_entry(head, element_t, list), first);
+        else
+            order_link(q, last, list_first_entry(head, element_t, list));
+    }
+    element_t *node;
+    list_for_each_entry (node, &chain, list) {
+        if (node != last)
+            order_link(q, node, list_entry(node->list.next, element_t, list));
+    }
+
+    /* Pushes in the order of insertion; ix_reserve() made sure they fit */
+    for (struct list_head *pos = tail ? chain.next : chain.prev; pos != &chain;
+         pos = tail ? pos->next : pos->prev) {
+        node = list_entry(pos, element_t, list);
+        if (tail)
+            ix_push_tail(q, node);
+        else
+            ix_push_head(q, node);
+        q->size++;
+    }
+    if (tail)
+        list_splice_tail(&chain, head);
+    else
+        list_splice(&chain, head);
+    return true;
+}
+
+/* Insert n elements at head of queue, one after the other */
+bool q_insert_head_bulk(struct list_head *head, char **s, int n)
+{
+    return q_insert_bulk(head, s, n, q_reversed(head));
+}
+
+/* Insert n elements at tail of queue, one after the other */
+bool q_insert_tail_bulk(struct list_head *head, char **s, int n)
+{
+    return q_insert_bulk(head, s, n, !q_reversed(head));
+}
+
+/* Unlink the element at the head or the tail of the nodes. Only the string
+ * and its terminator are copied to sp, not the whole buffer as strncpy()
+ * would; the full length of the string goes to len.
+ */
+static element_t *q_remove(struct list_head *head,
+                           char *sp,
+                           size_t bufsize,
+                           size_t *len,
+                           bool tail)
+{
+    if (!head || list_empty(head))
+        return NULL;
+    struct list_head *pos = tail ? head->prev : head->next;
+    element_t *node = list_entry(pos, element_t, list);
+    list_del(pos);
+    if (tail)
+        ix_pop_tail(queue_of(head));
+    else
+        ix_pop_head(queue_of(head));
+    queue_of(head)->size--;
+    order_unlinked(queue_of(head));
+    size_t n = node->value ? strlen(node->value) : 0;
+    if (len)
+        *len = n;
+    if (sp && bufsize > 0 && node->value) {
+        if (n > bufsize - 1)
+            n = bufsize - 1;
+        memcpy(sp, node->value, n);
+        sp[n] = '\0';
+    }
+    return node;
+}
+
+/* Remove an element from head of queue */
+element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+{
+    return q_remove(head, sp, bufsize, NULL, q_reversed(head));
+}
+
+/* Remove an element from tail of queue */
+element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
+{
+    return q_remove(head, sp, bufsize, NULL, !q_reversed(head));
+}
+
+/* Remove an element from head of queue, telling the length of its string */
+element_t *q_remove_head_len(struct list_head *head,
+                             char *sp,
+                             size_t bufsize,
+                             size_t *len)
+{
+    return q_remove(head, sp, bufsize, len, q_reversed(head));
+}
+
+/* Remove an element from tail of queue, telling the length of its string */
+element_t *q_remove_tail_len(struct list_head *head,
+                             char *sp,
+                             size_t bufsize,
+                             size_t *len)
+{
+    return q_remove(head, sp, bufsize, len, !q_reversed(head));
+}
+
+/* Unlink the first n elements of queue into list. A queue read front to back
+ * gives them up in one cut; a reversed one starts at its last node and goes
+ * on through prev, so its nodes are moved over one at a time.
+ */
+int q_remove_head_n(struct list_head *head, int n, struct list_head *list)
+{
+    if (!list)
+        return 0;
+    INIT_LIST_HEAD(list);
+    if (!head || n <= 0 || list_empty(head))
+        return 0;
+    queue_t *q = queue_of(head);
+    if (n > q->size)
+        n = q->size;
+    if (q->reversed) {
+        for (int i = 0; i < n; i++) {
+            list_move_tail(head->prev, list);
+            ix_pop_tail(q);
+        }
+    } else {
+        struct list_head *cut = head;
+        for (int i = 0; i < n; i++) {
+            cut = cut->next;
+            ix_pop_head(q);
+        }
+        list_cut_position(list, head, cut);
+    }
+    q->size -= n;
+    order_unlinked(q);
+    return n;
+}
+
+/* Return number of elements in queue */
+int q_size(struct list_head *head)
+{
+    if (!head)
+        return 0;
+    return queue_of(head)->size;
+}
+
+/* Tell whether the queue reads from head->prev to head->next */
+bool q_reversed(struct list_head *head)
+{
+    return head && queue_of(head)->reversed;
+}
+
+/* Orders the queue is known to be in */
+int q_order(struct list_head *head)
+{
+    if (!head)
+        return 0;
+    queue_t *q = queue_of(head);
+    return q->reversed ? order_flip(q->order) : q->order;
+}
+
+/* Reverse the nodes of a lazily reversed queue, which then reads forwards */
+static void queue_settle(queue_t *q)
+{
+    if (!q->reversed)
+        return;
+    q->reversed = false;
+    q->order = order_flip(q->order);
+    struct list_head *head = &q->head;
+    if (list_empty(head) || list_is_singular(head))
+        return;
+    if (ix_reverse(q))
+        return;
+    struct list_head *pos, *safe, *ahead;
+    list_for_each_safe_prefetch (pos, safe, ahead, head) {
+        struct list_head *next = pos->next;
+        struct list_head *prev = pos->prev;
+        pos->prev = next;
+        pos->next = prev;
+    }
+    struct list_head *h_next = head->next;
+    head->next = head->prev;
+    head->prev = h_next;
+}
+
+/* Delete the middle node in queue */
+bool q_delete_mid(struct list_head *head)
+{
+    // https://leetcode.com/problems/delete-the-middle-node-of-a-linked-list/
+    if (!head || list_empty(head))
+        return false;
+    int n = (q_size(head) - 1) >> 1;
+    if (q_reversed(head))
+        n = q_size(head) - 1 - n;
+    element_t *node = ix_take(queue_of(head), n);
+    if (!node) {
+        struct list_head *pos = head->next;
+        for (int i = 0; i < n; i++) {
+            pos = pos->next;
+        }
+        node = list_entry(pos, element_t, list);
+        list_del(pos);
+    }
+    queue_of(head)->size--;
+    order_unlinked(queue_of(head));
+    q_release_element(node);
+    return true;
+}
+
+/* Delete all nodes that have duplicate string */
+bool q_delete_dup(struct list_head *head)
+{
+    // https://leetcode.com/problems/remove-duplicates-from-sorted-list-ii/
+    if (!head || list_empty(head))
+        return false;
+    /* Strictly ordered queues hold no equal strings at all */
+    if (queue_of(head)->order & Q_ORDER_STRICT)
+        return true;
+    struct list_head *pos, *safe, *ahead;
+    bool dup = false;
+    list_for_each_safe_prefetch (pos, safe, ahead, head) {
+        element_t *node = list_entry(pos, element_t, list);
+        if (safe != head) {
+            const element_t *node_next = list_entry(safe, element_t, list);
+            if (element_eq(node, node_next)) {
+                dup = true;
+                list_del(pos);
+                queue_of(head)->size--;
+                q_release_element(node);
+                continue;
+            }
+            if (dup) {
+                list_del(pos);
+                queue_of(head)->size--;
+                q_release_element(node);
+                dup = false;
+            }
+            continue;
+        }
+        if (dup) {
+            list_del(pos);
+            queue_of(head)->size--;
+            q_release_element(node);
+        }
+        break;
+    }
+    /* Equal strings of an ordered queue are adjacent, so none are left */
+    if (queue_of(head)->order)
+        queue_of(head)->order |= Q_ORDER_STRICT;
+    order_unlinked(queue_of(head));
+    ix_rebuild(queue_of(head));
+    return true;
+}
+
+/* Swap every two adjacent nodes */
+void q_swap(struct list_head *head)
+{
+    // https://leetcode.com/problems/swap-nodes-in-pairs/
+    if (!head || list_empty(head))
+        return;
+    /* Pairs only line up the same from both ends if their number is even */
+    if (q_size(head) & 1)
+        queue_settle(queue_of(head));
+    struct list_head *pos, *safe;
+    for (pos = head->next, safe = pos->next; pos != head && safe != head;
+         pos = pos->next, safe = pos->next) {
+        list_del(pos);
+        list_add(pos, safe);
+    }
+    order_permuted(queue_of(head));
+    ix_rebuild(queue_of(head));
+}
+
+/* Reverse elements in queue, in O(1) by flipping the direction it reads in */
+void q_reverse(struct list_head *head)
+{
+    if (!head || list_empty(head) || list_is_singular(head))
+        return;
+    queue_of(head)->reversed = !queue_of(head)->reversed;
+}
+
+/* Reverse the nodes of the list k at a time */
+void q_reverseK(struct list_head *head, int k)
+{
+    // https://leetcode.com/problems/reverse-nodes-in-k-group/
+    if (!head || list_empty(head) || list_is_singular(head) || k == 1)
+        return;
+    queue_settle(queue_of(head));
+    struct list_head *pos = head->next, *safe, *first, *first_prev;
+    int num = q_size(head);
+    for (int i = 0; i < num / k; i++) {
+        struct list_head **first_next = NULL;
+        int m = 0;
+        for (safe = pos->next; m < k; pos = safe, safe = pos->next, m++) {
+            struct list_head *next = pos->next;
+            struct list_head *prev = pos->prev;
+            if (m == 0) {
+                first = pos;
+                first_prev = prev;
+                first_next = &pos->next;
+                pos->prev = next;
+                continue;
+            }
+            if (0 < m && m < k - 1) {
+                pos->prev = next;
+                pos->next = prev;
+                continue;
+            }
+            if (m == k - 1) {
+                pos->next = prev;
+                pos->prev = first_prev;
+                *first_next = next;
+                first_prev->next = pos;
+                next->prev = first;
+                pos = next;
+                break;
+            }
+        }
+    }
+    order_permuted(queue_of(head));
+    ix_rebuild(queue_of(head));
+}
+
+
+struct list_head *merge(struct list_head *l1,
+                        struct list_head *l2,
+                        bool descend)
+{
+    struct list_head tmp;
+    INIT_LIST_HEAD(&tmp);
+    struct list_head *tail = &tmp;
+    if (!descend) {
+        while (l1 && l2) {
+            const element_t *node1 = list_entry(l1, element_t, list);
+            const element_t *node2 = list_entry(l2, element_t, list);
+            if (element_cmp(node1, node2) <= 0) {
+                tail->next = l1;
+                l1->prev = tail;
+                tail = tail->next;
+                l1 = l1->next;
+            } else {
+                tail->next = l2;
+                l2->prev = tail;
+                tail = tail->next;
+                l2 = l2->next;
+            }
+        }
+    } else {
+        while (l1 && l2) {
+            const element_t *node1 = list_entry(l1, element_t, list);
+            const element_t *node2 = list_entry(l2, element_t, list);
+            if (element_cmp(node1, node2) >= 0) {
+                tail->next = l1;
+                l1->prev = tail;
+                tail = tail->next;
+                l1 = l1->next;
+            } else {
+                l2->prev = tail;
+                tail->next = l2;
+                tail = tail->next;
+                l2 = l2->next;
+            }
+        }
+    }
+    if (l1) {
+        tail->next = l1;
+        l1->prev = tail;
+    }
+    if (l2) {
+        tail->next = l2;
+        l2->prev = tail;
+    }
+    return tmp.next;
+}
+struct list_head *mergeSortList(struct list_head *node, bool descend)
+{
+    if (!node || !node->next)
+        return node;
+    struct list_head *fast = node->next;
+    struct list_head *slow = node;
+    // split list
+    while (fast && fast->next) {
+        slow = slow->next;
+        fast = fast->next->next;
+    }
+    fast = slow->next;
+    slow->next = NULL;
+    if (fast) {
+        fast->prev = NULL;
+    }
+
+    // sort each list
+    struct list_head *l1 = mergeSortList(node, descend);
+    struct list_head *l2 = mergeSortList(fast, descend);
+    return merge(l1, l2, descend);
+}
+/* Recursive top-down merge sort, kept as a reference for benchmarks */
+static void sort_top_down(struct list_head *head, bool descend)
+{
+    struct list_head *first_node = head->next;
+    struct list_head *last_node = head->prev;
+    first_node->prev = NULL;
+    last_node->next = NULL;
+    struct list_head *merge_pos = mergeSortList(first_node, descend);
+    if (!merge_pos) {
+        INIT_LIST_HEAD(head);
+        return;
+    }
+    head->next = merge_pos;
+    merge_pos->prev = head;
+    while (merge_pos->next) {
+        merge_pos = merge_pos->next;
+    }
+    merge_pos->next = head;
+    head->prev = merge_pos;
+}
+
+/* Order of two nodes; ties keep a in front of b, which makes merges stable */
+static inline int node_cmp(const struct list_head *a,
+                           const struct list_head *b,
+                           bool descend)
+{
+    int r = element_cmp(list_entry(a, element_t, list),
+                        list_entry(b, element_t, list));
+    return descend ? -r : r;
+}
+
+/* Merge two NULL-terminated runs linked through next, a coming first */
+static struct list_head *merge_runs(struct list_head *a,
+                                    struct list_head *b,
+                                    bool descend)
+{
+    struct list_head *head = NULL, **tail = &head;
+
+    for (;;) {
+        if (node_cmp(a, b, descend) <= 0) {
+            *tail = a;
+            tail = &a->next;
+            a = a->next;
+            if (!a) {
+                *tail = b;
+                break;
+            }
+        } else {
+            *tail = b;
+            tail = &b->next;
+            b = b->next;
+            if (!b) {
+                *tail = a;
+                break;
+            }
+        }
+    }
+    return head;
+}
+
+/* Last merge, which also restores the prev links and closes the circle */
+static void merge_final(struct list_head *head,
+                        struct list_head *a,
+                        struct list_head *b,
+                        bool descend)
+{
+    struct list_head *tail = head;
+
+    while (a && b) {
+        if (node_cmp(a, b, descend) <= 0) {
+            tail->next = a;
+            a->prev = tail;
+            tail = a;
+            a = a->next;
+        } else {
+            tail->next = b;
+            b->prev = tail;
+            tail = b;
+            b = b->next;
+        }
+    }
+    for (a = a ? a : b; a; a = a->next) {
+        tail->next = a;
+        a->prev = tail;
+        tail = a;
+    }
+    tail->next = head;
+    head->prev = tail;
+}
+
+/* Iterative bottom-up merge sort modeled after list_sort() in the Linux
+ * kernel. Nodes are pushed one at a time onto a stack of pending sorted runs
+ * whose sizes are powers of two, chained through prev. Whenever the number of
+ * nodes seen so far says two runs of equal size sit on top of each other, they
+ * are merged, which keeps merges balanced at a 2:1 ratio at worst without ever
+ * looking for a midpoint and without recursion.
+ */
+static void sort_bottom_up(struct list_head *head, bool descend)
+{
+    struct list_head *list = head->next, *pending = NULL;
+    size_t count = 0;
+
+    head->prev->next = NULL;
+    do {
+        size_t bits;
+        struct list_head **tail = &pending;
+
+        /* Find the least-significant clear bit in count */
+        for (bits = count; bits & 1; bits >>= 1)
+            tail = &(*tail)->prev;
+        /* Do the indicated merge, unless count is one less than a power of 2 */
+        if (bits) {
+            struct list_head *a = *tail, *b = a->prev;
+
+            a = merge_runs(b, a, descend);
+            a->prev = b->prev;
+            *tail = a;
+        }
+
+        /* Move one node from the input onto pending as a run of length 1 */
+        list->prev = pending;
+        pending = list;
+        list = list->next;
+        pending->next = NULL;
+        count++;
+    } while (list);
+
+    /* Fold all pending runs together, newest first */
+    list = pending;
+    pending = pending->prev;
+    for (;;) {
+        struct list_head *next = pending->prev;
+
+        if (!next)
+            break;
+        list = merge_runs(pending, list, descend);
+        pending = next;
+    }
+    merge_final(head, pending, list, descend);
+}
+
+/* Run-adaptive merge sort in the spirit of Timsort.
+ *
+ * The input is cut into natural runs: maximal non-decreasing stretches, or
+ * non-increasing ones which are reversed in place while keeping equal strings
+ * in order. Runs shorter than MIN_RUN are grown by insertion. Runs are kept on
+ * a small stack and merged following the Timsort invariants, so already sorted
+ * or reversed input is a single run and costs one linear pass. Merges switch
+ * to galloping once one side keeps winning: the stretch that still wins is
+ * located by exponential probing plus a binary search, then spliced in with a
+ * single link update.
+ */
+#define MIN_GALLOP 7
+#define MIN_RUN 16
+
+/* A run is NULL-terminated and linked through next only */
+struct run {
+    struct list_head *head, *tail;
+    size_t len;
+};
+
+/* With the invariants kept by merge_collapse(), run lengths grow at least as
+ * fast as the Fibonacci numbers, so this is enough for any size_t count.
+ */
+#define RUN_STACK_MAX 96
+
+/* Cut the next natural run off list, returning what is left of the input.
+ * A run that starts out decreasing is taken as long as it does not increase
+ * and is reversed on the fly. Equal strings inside it are appended to their
+ * group instead of being pushed in front of it, which keeps them in input
+ * order: reversed input containing duplicates is still a single run.
+ */
+static struct list_head *find_run(struct list_head *list,
+                                  struct run *run,
+                                  bool descend)
+{
+    struct list_head *next = list->next;
+    int r;
+
+    run->len = 1;
+    if (next && (r = node_cmp(list, next, descend)) > 0) {
+        struct list_head *group = list;
+
+        run->head = run->tail = list;
+        list->next = NULL;
+        do {
+            struct list_head *node = next;
+
+            next = node->next;
+            if (r) {
+                node->next = run->head;
+                run->head = node;
+            } else {
+                node->next = group->next;
+                group->next = node;
+            }
+            group = node;
+            list = node;
+            run->len++;
+        } while (next && (r = node_cmp(list, next, descend)) >= 0);
+        return next;
+    }
+
+    run->head = list;
+    while (next && node_cmp(list, next, descend) <= 0) {
+        list = next;
+        next = list->next;
+        run->len++;
+    }
+    list->next = NULL;
+    run->tail = list;
+    return next;
+}
+
+/* Grow a short run to MIN_RUN nodes by insertion, as random input would
+ * otherwise produce a swarm of tiny runs. Returns what is left of the input.
+ */
+static struct list_head *extend_run(struct list_head *list,
+                                    struct run *run,
+                                    bool descend)
+{
+    while (list && run->len < MIN_RUN) {
+        struct list_head *node = list, **pos = &run->head;
+
+        list = list->next;
+        if (node_cmp(run->tail, node, descend) <= 0) {
+            run->tail->next = node;
+            run->tail = node;
+            node->next = NULL;
+        } else {
+            /* Equal nodes already in the run stay in front */
+            while (node_cmp(*pos, node, descend) <= 0)
+                pos = &(*pos)->next;
+            node->next = *pos;
+            *pos = node;
+        }
+        run->len++;
+    }
+    return list;
+}
+
+/* Does node x go before pivot? Nodes from the earlier run win ties. */
+static inline bool goes_before(const struct list_head *x,
+                               const struct list_head *pivot,
+                               bool earlier,
+                               bool descend)
+{
+    int r = node_cmp(x, pivot, descend);
+    return earlier ? r <= 0 : r < 0;
+}
+
+/* Starting from x, which goes before pivot, find the last node of the stretch
+ * that still does. Probe 1, 2, 4, ... nodes ahead, then bisect the last gap.
+ * The number of nodes skipped past x is stored in skipped.
+ */
+static struct list_head *gallop(struct list_head *x,
+                                const struct list_head *pivot,
+                                bool earlier,
+                                bool descend,
+                                size_t *skipped)
+{
+    size_t step = 1;
+
+    *skipped = 0;
+    for (;;) {
+        struct list_head *probe = x;
+        size_t dist = 0;
+
+        while (dist < step && probe->next) {
+            probe = probe->next;
+            dist++;
+        }
+        if (!dist)
+            return x;
+        if (goes_before(probe, pivot, earlier, descend)) {
+            x = probe;
+            *skipped += dist;
+            step <<= 1;
+            continue;
+        }
+
+        /* x goes before pivot and the node dist hops further does not */
+        while (dist > 1) {
+            size_t half = dist / 2;
+            struct list_head *mid = x;
+            for (size_t i = 0; i < half; i++)
+                mid = mid->next;
+            if (goes_before(mid, pivot, earlier, descend)) {
+                x = mid;
+                *skipped += half;
+                dist -= half;
+            } else {
+                dist = half;
+            }
+        }
+        return x;
+    }
+}
+
+/* Pending runs, plus the win streak that currently triggers galloping */
+struct merge_state {
+    struct run run[RUN_STACK_MAX];
+    size_t n;
+    size_t min_gallop;
+};
+
+/* Gallop from x towards pivot. Like Timsort, make the next gallop easier to
+ * enter when this one paid off and harder when it did not: walking a linked
+ * list to probe costs about as much as comparing one node at a time.
+ */
+static struct list_head *gallop_tuned(struct merge_state *ms,
+                                      struct list_head *x,
+                                      const struct list_head *pivot,
+                                      bool earlier,
+                                      bool descend)
+{
+    size_t skipped;
+    struct list_head *last = gallop(x, pivot, earlier, descend, &skipped);
+
+    if (skipped >= MIN_GALLOP) {
+        if (ms->min_gallop > 1)
+            ms->min_gallop--;
+    } else {
+        ms->min_gallop += 2;
+    }
+    return last;
+}
+
+/* Merge run b, which follows run a in the input, into a */
+static void merge_gallop(struct merge_state *ms,
+                         struct run *a,
+                         const struct run *b,
+                         bool descend)
+{
+    struct list_head *x = a->head, *y = b->head;
+    struct list_head *head = NULL, **tail = &head;
+    size_t wins_x = 0, wins_y = 0;
+
+    /* Runs which are already in order, either way round, are concatenated */
+    if (node_cmp(a->tail, y, descend) <= 0) {
+        a->tail->next = y;
+        a->tail = b->tail;
+        a->len += b->len;
+        return;
+    }
+    if (node_cmp(b->tail, x, descend) < 0) {
+        b->tail->next = x;
+        a->head = y;
+        a->len += b->len;
+        return;
+    }
+
+    for (;;) {
+        if (node_cmp(x, y, descend) <= 0) {
+            struct list_head *last = x;
+            if (++wins_x >= ms->min_gallop) {
+                last = gallop_tuned(ms, x, y, true, descend);
+                wins_x = 0;
+            }
+            wins_y = 0;
+            *tail = x;
+            tail = &last->next;
+            x = last->next;
+            if (!x) {
+                *tail = y;
+                a->tail = b->tail;
+                break;
+            }
+        } else {
+            struct list_head *last = y;
+            if (++wins_y >= ms->min_gallop) {
+                last = gallop_tuned(ms, y, x, false, descend);
+                wins_y = 0;
+            }
+            wins_x = 0;
+            *tail = y;
+            tail = &last->next;
+            y = last->next;
+            if (!y) {
+                *tail = x;
+                break;
+            }
+        }
+    }
+    a->head = head;
+    a->len += b->len;
+}
+
+/* Merge pending runs i and i + 1 */
+static void merge_at(struct merge_state *ms, size_t i, bool descend)
+{
+    merge_gallop(ms, &ms->run[i], &ms->run[i + 1], descend);
+    if (i + 2 < ms->n)
+        ms->run[i + 1] = ms->run[i + 2];
+    ms->n--;
+}
+
+/* Restore the run length invariants on the pending stack */
+static void merge_collapse(struct merge_state *ms, bool descend)
+{
+    struct run *run = ms->run;
+
+    while (ms->n > 1) {
+        size_t i = ms->n - 2;
+
+        if ((i > 0 && run[i - 1].len <= run[i].len + run[i + 1].len) ||
+            (i > 1 && run[i - 2].len <= run[i - 1].len + run[i].len)) {
+            if (run[i - 1].len < run[i + 1].len)
+                i--;
+        } else if (run[i].len > run[i + 1].len) {
+            break;
+        }
+        merge_at(ms, i, descend);
+    }
+}
+
+static void sort_adaptive(struct list_head *head, bool descend)
+{
+    struct merge_state ms = {.n = 0, .min_gallop = MIN_GALLOP};
+    struct list_head *list = head->next;
+
+    head->prev->next = NULL;
+    while (list) {
+        list = find_run(list, &ms.run[ms.n], descend);
+        list = extend_run(list, &ms.run[ms.n++], descend);
+        merge_collapse(&ms, descend);
+    }
+    while (ms.n > 2) {
+        size_t i = ms.n - 2;
+        if (ms.run[i - 1].len < ms.run[i + 1].len)
+            i--;
+        merge_at(&ms, i, descend);
+    }
+    if (ms.n == 2) {
+        merge_final(head, ms.run[0].head, ms.run[1].head, descend);
+        return;
+    }
+
+    /* A single run is only linked through next; rebuild prev and the circle */
+    struct list_head *prev = head;
+    for (list = ms.run[0].head; list; list = list->next) {
+        prev->next = list;
+        list->prev = prev;
+        prev = list;
+    }
+    prev->next = head;
+    head->prev = prev;
+}
+
+int q_sort_engine = Q_SORT_ADAPTIVE;
+
+/* Most significant digit radix sort. Nodes are dealt into 256 buckets by the
+ * byte at the current depth, keeping their order within a bucket, and every
+ * bucket except the one of strings that end here is sorted recursively one
+ * byte further in. Small buckets are finished by insertion sort. The buckets
+ * of one level sit on the stack, and below RADIX_MAX_DEPTH the remaining
+ * bucket is handed to the adaptive merge sort, so the stack stays bounded no
+ * matter how long the common prefixes are.
+ */
+#define RADIX_SMALL 16
+#define RADIX_MAX_DEPTH 32
+
+/* Compare two strings known to agree on their first depth bytes */
+static inline int radix_cmp(const struct list_head *a,
+                            const struct list_head *b,
+                            size_t depth,
+                            bool descend)
+{
+    const element_t *x = list_entry(a, element_t, list);
+    const element_t *y = list_entry(b, element_t, list);
+    int r = depth < ELEMENT_KEY_BYTES
+                ? element_cmp(x, y)
+                : simd_strcmp(x->value + depth, y->value + depth);
+    return descend ? -r : r;
+}
+
+/* Byte depth of the string, read from the key while it covers depth */
+static inline unsigned element_byte(const element_t *e, size_t depth)
+{
+    if (depth < ELEMENT_KEY_BYTES)
+        return (e->key >> 8 * (ELEMENT_KEY_BYTES - 1 - depth)) & 0xff;
+    return (unsigned char) e->value[depth];
+}
+
+/* Stable insertion sort of a short NULL-terminated run */
+static struct list_head *radix_insertion(struct list_head *list,
+                                         struct list_head **tail,
+                                         size_t depth,
+                                         bool descend)
+{
+    struct list_head *head = NULL, *last = NULL;
+
+    while (list) {
+        struct list_head *node = list, **pos = &head;
+
+        list = list->next;
+        if (last && radix_cmp(last, node, depth, descend) <= 0) {
+            pos = &last->next;
+        } else {
+            while (*pos && radix_cmp(*pos, node, depth, descend) <= 0)
+                pos = &(*pos)->next;
+        }
+        node->next = *pos;
+        *pos = node;
+        if (!node->next)
+            last = node;
+    }
+    *tail = last;
+    return head;
+}
+
+/* Sort a NULL-terminated run of n nodes whose strings share depth bytes */
+static struct list_head *radix_sort(struct list_head *list,
+                                    size_t n,
+                                    size_t depth,
+                                    struct list_head **tail,
+                                    bool descend)
+{
+    if (n <= RADIX_SMALL)
+        return radix_insertion(list, tail, depth, descend);
+
+    if (depth >= RADIX_MAX_DEPTH) {
+        struct list_head tmp = {.next = list};
+        struct list_head *last = list;
+
+        while (last->next)
+            last = last->next;
+        last->next = &tmp;
+        tmp.prev = last;
+        sort_adaptive(&tmp, descend);
+        tmp.prev->next = NULL;
+        *tail = tmp.prev;
+        return tmp.next;
+    }
+
+    struct list_head *head[256], **link[256];
+    size_t count[256] = {0};
+    unsigned lo = 255, hi = 0;
+
+    while (list) {
+        struct list_head *node = list;
+        unsigned c = element_byte(list_entry(node, element_t, list), depth);
+
+        list = list->next;
+        if (!count[c]++) {
+            link[c] = &head[c];
+            if (c < lo)
+                lo = c;
+            if (c > hi)
+                hi = c;
+        }
+        *link[c] = node;
+        link[c] = &node->next;
+    }
+
+    struct list_head *result = NULL, **out = &result;
+    for (unsigned i = lo; i <= hi; i++) {
+        unsigned c = descend ? lo + hi - i : i;
+        struct list_head *sub_tail;
+
+        if (!count[c])
+            continue;
+        *link[c] = NULL;
+        if (c && count[c] > 1) {
+            *out = radix_sort(head[c], count[c], depth + 1, &sub_tail, descend);
+        } else {
+            *out = head[c];
+            sub_tail = container_of(link[c], struct list_head, next);
+        }
+        out = &sub_tail->next;
+        *tail = sub_tail;
+    }
+    return result;
+}
+
+static void sort_radix(struct list_head *head, bool descend)
+{
+    struct list_head *tail, *list;
+
+    /* head may be a segment of the parallel sort rather than a queue, so its
+     * length is not known here; any length above RADIX_SMALL will do.
+     */
+    head->prev->next = NULL;
+    list = radix_sort(head->next, SIZE_MAX, 0, &tail, descend);
+
+    struct list_head *prev = head;
+    for (; list; list = list->next) {
+        prev->next = list;
+        list->prev = prev;
+        prev = list;
+    }
+    prev->next = head;
+    head->prev = prev;
+}
+
+/* Sort a list of at least two nodes with the selected sequential engine */
+static void sort_list(struct list_head *head, bool descend)
+{
+    switch (q_sort_engine) {
+    case Q_SORT_BOTTOM_UP:
+        sort_bottom_up(head, descend);
+        break;
+    case Q_SORT_TOP_DOWN:
+        sort_top_down(head, descend);
+        break;
+    case Q_SORT_RADIX:
+        sort_radix(head, descend);
+        break;
+    default:
+        sort_adaptive(head, descend);
+        break;
+    }
+}
+
+/* q_merge() runs a tournament over the queues of the chain: a loser tree whose
+ * leaves are the remaining parts of the queues and whose internal nodes keep
+ * the source that lost the match played there. The winner is emitted and its
+ * source replays only the matches on its path to the root, so each element
+ * costs about log2(k) comparisons. The tree lives on the stack; chains longer
+ * than MERGE_WAYS are merged MERGE_WAYS - 1 queues at a time into the first.
+ */
+#define MERGE_WAYS 1024
+
+struct tournament {
+    struct list_head *run[MERGE_WAYS]; /* NULL-terminated, linked via next */
+    unsigned short loser[MERGE_WAYS];  /* loser[0] is the overall winner */
+    unsigned k;
+};
+
+/* Does source i win over source j? Ties go to the earlier queue. */
+static inline bool run_beats(const struct tournament *t,
+                             unsigned i,
+                             unsigned j,
+                             bool descend)
+{
+    if (!t->run[j])
+        return true;
+    if (!t->run[i])
+        return false;
+    int r = node_cmp(t->run[i], t->run[j], descend);
+    return r < 0 || (!r && i < j);
+}
+
+/* Detach the elements of a queue as a run, leaving the queue empty */
+static void tournament_add(struct tournament *t, struct list_head *q)
+{
+    if (list_empty(q))
+        return;
+    q->prev->next = NULL;
+    t->run[t->k++] = q->next;
+    INIT_LIST_HEAD(q);
+}
+
+/* Merge all runs of t into the empty queue head */
+static void tournament_merge(struct tournament *t,
+                             struct list_head *head,
+                             bool descend)
+{
+    unsigned k = t->k, w;
+    struct list_head *tail = head;
+
+    if (!k)
+        return;
+
+    /* Leaves are k..2k-1 and node p plays the winners of 2p and 2p + 1. The
+     * first source to reach a node waits there for its opponent.
+     */
+    for (unsigned p = 0; p < k; p++)
+        t->loser[p] = MERGE_WAYS;
+    for (unsigned i = 0; i < k; i++) {
+        unsigned p;
+        w = i;
+        for (p = (i + k) >> 1; p; p >>= 1) {
+            unsigned x = t->loser[p];
+            if (x == MERGE_WAYS) {
+                t->loser[p] = w;
+                break;
+            }
+            if (run_beats(t, x, w, descend)) {
+                t->loser[p] = w;
+                w = x;
+            }
+        }
+        if (!p)
+            t->loser[0] = w;
+    }
+
+    for (w = t->loser[0]; t->run[w]; t->loser[0] = w) {
+        struct list_head *node = t->run[w];
+
+        tail->next = node;
+        node->prev = tail;
+        tail = node;
+        t->run[w] = node->next;
+        for (unsigned p = (w + k) >> 1; p; p >>= 1) {
+            unsigned x = t->loser[p];
+            if (run_beats(t, x, w, descend)) {
+                t->loser[p] = w;
+                w = x;
+            }
+        }
+    }
+    tail->next = head;
+    head->prev = tail;
+    t->k = 0;
+}
+
+/* Parallel sort, in the style of parallel sorting by regular sampling. The
+ * list is cut into one segment per thread and every phase below runs on all
+ * threads at once:
+ *   1. each thread sorts its segment with the sequential engine and picks
+ *      t - 1 evenly spaced samples from it;
+ *   2. t - 1 pivots are chosen among the sorted samples, and each thread cuts
+ *      its sorted segment into t pieces, piece j holding what falls between
+ *      pivots j - 1 and j;
+ *   3. thread j merges piece j of every segment with a loser tree.
+ * The merged buckets are then concatenated in order. Equal strings always land
+ * in the same bucket and ties go to the earlier segment, so the result is the
+ * same stable order the sequential sort produces. All bookkeeping lives on the
+ * stack, nothing is allocated while sorting.
+ */
+#define PARALLEL_GRAIN 16384 /* fewest nodes worth handing to a thread */
+
+int q_sort_threads = 1;
+
+struct psort {
+    unsigned t;
+    bool descend;
+    struct list_head seg[Q_SORT_MAX_THREADS];
+    size_t len[Q_SORT_MAX_THREADS];
+    struct list_head *sample[Q_SORT_MAX_THREADS * (Q_SORT_MAX_THREADS - 1)];
+    struct list_head *pivot[Q_SORT_MAX_THREADS - 1];
+    struct list_head *piece[Q_SORT_MAX_THREADS][Q_SORT_MAX_THREADS];
+    struct list_head bucket[Q_SORT_MAX_THREADS];
+};
+
+typedef void (*psort_job_t)(struct psort *ps, unsigned id);
+
+/* Worker threads are started by q_sort_start_threads() and sleep between jobs.
+ * The calling thread takes part in every job as worker 0.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t start, finish;
+    pthread_t thread[Q_SORT_MAX_THREADS - 1];
+    unsigned workers; /* running threads besides the caller */
+    unsigned round;   /* bumped each time a job is handed out */
+    unsigned first;   /* value of round when the workers were started */
+    unsigned busy;    /* workers still on the current job */
+    bool quit;
+    psort_job_t job;
+    struct psort *ps;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .finish = PTHREAD_COND_INITIALIZER,
+};
+
+static void *pool_worker(void *arg)
+{
+    unsigned id = (uintptr_t) arg;
+
+    pthread_mutex_lock(&pool.lock);
+    unsigned seen = pool.first;
+    for (;;) {
+        while (pool.round == seen && !pool.quit)
+            pthread_cond_wait(&pool.start, &pool.lock);
+        if (pool.quit)
+            break;
+        seen = pool.round;
+        psort_job_t job = pool.job;
+        struct psort *ps = pool.ps;
+        pthread_mutex_unlock(&pool.lock);
+
+        if (id < ps->t)
+            job(ps, id);
+
+        pthread_mutex_lock(&pool.lock);
+        if (!--pool.busy)
+            pthread_cond_signal(&pool.finish);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/* Run job on ids 0 .. ps->t - 1 and wait until every worker is done */
+static void pool_run(psort_job_t job, struct psort *ps)
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.job = job;
+    pool.ps = ps;
+    pool.busy = pool.workers;
+    pool.round++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    job(ps, 0);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.busy)
+        pthread_cond_wait(&pool.finish, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Stop all workers, then start q_sort_threads - 1 new ones */
+bool q_sort_start_threads(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = true;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+    for (unsigned i = 0; i < pool.workers; i++)
+        pthread_join(pool.thread[i], NULL);
+    pool.workers = 0;
+    pool.quit = false;
+    pool.first = pool.round;
+
+    if (q_sort_threads < 1)
+        q_sort_threads = 1;
+    if (q_sort_threads > Q_SORT_MAX_THREADS)
+        q_sort_threads = Q_SORT_MAX_THREADS;
+
+    /* Workers must never see the alarm used to time out queue operations */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    while (pool.workers < (unsigned) q_sort_threads - 1) {
+        uintptr_t id = pool.workers + 1;
+        if (pthread_create(&pool.thread[pool.workers], NULL, pool_worker,
+                           (void *) id))
+            break;
+        pool.workers++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    bool ok = pool.workers + 1 == (unsigned) q_sort_threads;
+    q_sort_threads = pool.workers + 1;
+    return ok;
+}
+
+/* Phase 1: sort segment id, then sample it at regular intervals */
+static void psort_segment(struct psort *ps, unsigned id)
+{
+    struct list_head *seg = &ps->seg[id], *pos = seg->next;
+    struct list_head **sample = &ps->sample[id * (ps->t - 1)];
+    size_t next = 0;
+
+    sort_list(seg, ps->descend);
+    for (unsigned j = 1; j < ps->t; j++) {
+        size_t at = ps->len[id] * j / ps->t;
+        for (; next < at; next++)
+            pos = pos->next;
+        sample[j - 1] = pos;
+    }
+}
+
+/* Phase 2: cut sorted segment id into one piece per bucket */
+static void psort_split(struct psort *ps, unsigned id)
+{
+    struct list_head *seg = &ps->seg[id], **piece = ps->piece[id];
+    struct list_head *pos, *last = NULL;
+    unsigned b = 0;
+
+    for (unsigned j = 0; j < ps->t; j++)
+        piece[j] = NULL;
+    for (pos = seg->next; pos != seg; last = pos, pos = pos->next) {
+        if (b < ps->t - 1 && node_cmp(pos, ps->pivot[b], ps->descend) > 0) {
+            do
+                b++;
+            while (b < ps->t - 1 &&
+                   node_cmp(pos, ps->pivot[b], ps->descend) > 0);
+            if (last)
+                last->next = NULL;
+            last = NULL;
+        }
+        if (!last)
+            piece[b] = pos;
     }
-    return node;
+    if (last)
+        last->next = NULL;
 }
 
-/* Remove an element from tail of queue */
-element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
+/* Phase 3: merge piece id of every segment into bucket id */
+static void psort_merge(struct psort *ps, unsigned id)
 {
-    if (!head || list_empty(head))
-        return NULL;
-    element_t *node = list_entry(head->prev, element_t, list);
-    list_del(head->prev);
-    if (sp && bufsize > 0 && node->value) {
-        strncpy(sp, node->value, bufsize - 1);
-        sp[bufsize - 1] = '\0';
+    struct tournament t = {.k = 0};
+
+    for (unsigned i = 0; i < ps->t; i++) {
+        if (ps->piece[i][id])
+            t.run[t.k++] = ps->piece[i][id];
     }
-    return node;
+    INIT_LIST_HEAD(&ps->bucket[id]);
+    tournament_merge(&t, &ps->bucket[id], ps->descend);
 }
 
-/* Return number of elements in queue */
-int q_size(struct list_head *head)
+/* Order the samples by their strings with a Shell sort */
+static void psort_order_samples(struct psort *ps)
 {
-    if (!head || list_empty(head))
-        return 0;
-    struct list_head *pos;
-    int n = 0;
-    list_for_each (pos, head) {
-        n++;
+    static const size_t gaps[] = {701, 301, 132, 57, 23, 10, 4, 1};
+    size_t m = ps->t * (ps->t - 1);
+
+    for (size_t g = 0; g < sizeof(gaps) / sizeof(gaps[0]); g++) {
+        size_t gap = gaps[g];
+        for (size_t i = gap; i < m; i++) {
+            struct list_head *x = ps->sample[i];
+            size_t j = i;
+            for (; j >= gap &&
+                   node_cmp(ps->sample[j - gap], x, ps->descend) > 0;
+                 j -= gap)
+                ps->sample[j] = ps->sample[j - gap];
+            ps->sample[j] = x;
+        }
     }
-    return n;
 }
 
-/* Delete the middle node in queue */
-bool q_delete_mid(struct list_head *head)
+static void sort_parallel(struct list_head *head, unsigned t, bool descend)
 {
-    // https://leetcode.com/problems/delete-the-middle-node-of-a-linked-list/
-    if (!head || list_empty(head))
-        return false;
-    int n = (q_size(head) - 1) >> 1;
+    struct psort ps;
+    size_t n = q_size(head);
     struct list_head *pos = head->next;
-    for (int i = 0; i < n; i++) {
+
+    ps.t = t;
+    ps.descend = descend;
+    for (unsigned i = 0; i < t; i++) {
+        struct list_head *seg = &ps.seg[i], *first = pos;
+        size_t len = n / t + (i < n % t);
+
+        for (size_t k = 1; k < len; k++)
+            pos = pos->next;
+        seg->next = first;
+        first->prev = seg;
+        seg->prev = pos;
         pos = pos->next;
+        seg->prev->next = seg;
+        ps.len[i] = len;
     }
-    element_t *node = list_entry(pos, element_t, list);
-    list_del(pos);
-    q_release_element(node);
-    return true;
+
+    pool_run(psort_segment, &ps);
+
+    size_t m = t * (t - 1);
+    psort_order_samples(&ps);
+    for (unsigned j = 0; j < t - 1; j++)
+        ps.pivot[j] = ps.sample[(2 * j + 1) * m / (2 * (t - 1))];
+
+    pool_run(psort_split, &ps);
+    pool_run(psort_merge, &ps);
+
+    INIT_LIST_HEAD(head);
+    for (unsigned j = 0; j < t; j++)
+        list_splice_tail(&ps.bucket[j], head);
 }
 
-/* Delete all nodes that have duplicate string */
-bool q_delete_dup(struct list_head *head)
+#ifdef QUEUE_UNROLLED
+/* The unrolled backend sorts its index: every chunk is sorted by insertion,
+ * then runs of chunks are merged bottom-up, much like sort_bottom_up() does
+ * with runs of nodes. Runs are chains of chunks linked through list.next. Two
+ * runs that are already in order, either way round, are just chained; other
+ * merges fill chunks from the spare list and give back every input chunk
+ * they drain, so they are never more than three chunks ahead of what they
+ * free. The reserve covers that, and a merged run takes no more chunks than
+ * its inputs. Finally the list is relinked in index order.
+ *
+ * Most comparisons are settled by the keys copied into the slots, without
+ * touching the elements.
+ */
+struct ix_run {
+    struct uchunk *first, *last;
+};
+
+static inline bool ix_before(const struct ix_slot *a,
+                             const struct ix_slot *b,
+                             bool descend)
 {
-    // https://leetcode.com/problems/remove-duplicates-from-sorted-list-ii/
-    if (!head || list_empty(head))
-        return false;
-    struct list_head *pos, *safe;
-    bool dup = false;
-    list_for_each_safe (pos, safe, head) {
-        element_t *node = list_entry(pos, element_t, list);
-        if (safe != head) {
-            const element_t *node_next = list_entry(safe, element_t, list);
-            if (strcmp(node->value, node_next->value) == 0) {
-                dup = true;
-                list_del(pos);
-                q_release_element(node);
-                continue;
+    if (a->key != b->key)
+        return descend ? a->key > b->key : a->key < b->key;
+    if (!(a->key & 0xff))
+        return true;
+    int cmp = simd_strcmp(a->e->value + ELEMENT_KEY_BYTES,
+                          b->e->value + ELEMENT_KEY_BYTES);
+    return descend ? cmp >= 0 : cmp <= 0;
+}
+
+static void ix_sort_chunk(struct uchunk *c, bool descend)
+{
+    for (unsigned i = c->lo + 1; i < c->hi; i++) {
+        struct ix_slot e = c->slot[i];
+        unsigned j = i;
+        for (; j > c->lo && !ix_before(&c->slot[j - 1], &e, descend); j--)
+            c->slot[j] = c->slot[j - 1];
+        c->slot[j] = e;
+    }
+}
+
+static inline struct uchunk *ix_next(struct uchunk *c)
+{
+    return c->list.next ? list_entry(c->list.next, struct uchunk, list) : NULL;
+}
+
+static struct ix_run ix_merge(queue_t *q,
+                              struct ix_run ra,
+                              struct ix_run rb,
+                              bool descend)
+{
+    struct uchunk *a = ra.first, *b = rb.first;
+
+    if (ix_before(&ra.last->slot[ra.last->hi - 1], &b->slot[b->lo], descend)) {
+        ra.last->list.next = &b->list;
+        return (struct ix_run){a, rb.last};
+    }
+    if (!ix_before(&a->slot[a->lo], &rb.last->slot[rb.last->hi - 1],
+                   descend)) {
+        rb.last->list.next = &a->list;
+        return (struct ix_run){b, ra.last};
+    }
+
+    struct list_head head, *tail = &head;
+    struct uchunk *out = NULL;
+    unsigned i = a->lo, j = b->lo;
+    while (a || b) {
+        struct ix_slot e;
+        if (!b || (a && ix_before(&a->slot[i], &b->slot[j], descend))) {
+            e = a->slot[i];
+            if (++i == a->hi) {
+                struct uchunk *next = ix_next(a);
+                ix_put(q, a);
+                if ((a = next))
+                    i = a->lo;
             }
-            if (dup) {
-                list_del(pos);
-                q_release_element(node);
-                dup = false;
+        } else {
+            e = b->slot[j];
+            if (++j == b->hi) {
+                struct uchunk *next = ix_next(b);
+                ix_put(q, b);
+                if ((b = next))
+                    j = b->lo;
             }
-            continue;
         }
-        if (dup) {
-            list_del(pos);
-            q_release_element(node);
+        if (!out || out->hi == UCHUNK_SLOTS) {
+            out = ix_get(q, false);
+            out->lo = out->hi = 0;
+            tail->next = &out->list;
+            tail = &out->list;
         }
-        break;
+        out->slot[out->hi++] = e;
     }
-    return true;
+    tail->next = NULL;
+    return (struct ix_run){list_entry(head.next, struct uchunk, list), out};
 }
 
-/* Swap every two adjacent nodes */
-void q_swap(struct list_head *head)
+static bool ix_sort(queue_t *q, bool descend)
 {
-    // https://leetcode.com/problems/swap-nodes-in-pairs/
-    if (!head || list_empty(head))
-        return;
-    struct list_head *pos, *safe;
-    for (pos = head->next, safe = pos->next; pos != head && safe != head;
-         pos = pos->next, safe = pos->next) {
-        list_del(pos);
-        list_add(pos, safe);
+    struct ix_run pending[64], run;
+    struct uchunk *c, *safe;
+    uint64_t used = 0; /* bit lvl set when pending[lvl] holds a run */
+
+    list_for_each_entry_safe (c, safe, &q->chunks, list) {
+        ix_sort_chunk(c, descend);
+        c->list.next = NULL;
+        run = (struct ix_run){c, c};
+        size_t lvl;
+        for (lvl = 0; used & (1ULL << lvl); lvl++) {
+            run = ix_merge(q, pending[lvl], run, descend);
+            used &= ~(1ULL << lvl);
+        }
+        pending[lvl] = run;
+        used |= 1ULL << lvl;
+    }
+
+    /* Higher levels hold earlier elements */
+    bool any = false;
+    for (size_t lvl = 0; lvl < 64; lvl++) {
+        if (!(used & (1ULL << lvl)))
+            continue;
+        run = any ? ix_merge(q, pending[lvl], run, descend) : pending[lvl];
+        any = true;
+    }
+
+    /* Thread the chunks back into the index and the list along with them */
+    struct list_head *cprev = &q->chunks, *prev = &q->head;
+    for (c = run.first; c; c = ix_next(c)) {
+        c->list.prev = cprev;
+        cprev->next = &c->list;
+        cprev = &c->list;
+        for (unsigned i = c->lo; i < c->hi; i++) {
+            struct list_head *node = &c->slot[i].e->list;
+            prev->next = node;
+            node->prev = prev;
+            prev = node;
+        }
     }
+    cprev->next = &q->chunks;
+    q->chunks.prev = cprev;
+    prev->next = &q->head;
+    q->head.prev = prev;
+    return true;
 }
+#elif defined(QUEUE_RING)
+/* The ring backend sorts the ring in place, as q_sort() may not allocate the
+ * scratch space a stable merge would need. Instead, every element notes its
+ * position in list.prev, which is relinked afterwards anyway, and ties are
+ * broken by that position, so the result is stable even though the sort is
+ * not. It is an introsort: quicksort on a median-of-three pivot, insertion
+ * sort for short ranges and heapsort for ranges that partition badly.
+ * Partitioning streams through the array, so the elements it compares can be
+ * fetched ahead of time instead of one after another.
+ */
+#define RING_INSERTION 16
 
-/* Reverse elements in queue */
-void q_reverse(struct list_head *head)
+static inline bool ring_less(const element_t *a,
+                             const element_t *b,
+                             bool descend)
 {
-    if (!head || list_empty(head) || list_is_singular(head))
-        return;
-    struct list_head *pos, *safe;
-    list_for_each_safe (pos, safe, head) {
-        struct list_head *next = pos->next;
-        struct list_head *prev = pos->prev;
-        pos->prev = next;
-        pos->next = prev;
-    }
-    struct list_head *h_next = head->next;
-    head->next = head->prev;
-    head->prev = h_next;
+    int cmp = element_cmp(a, b);
+    if (cmp)
+        return descend ? cmp > 0 : cmp < 0;
+    return (uintptr_t) a->list.prev < (uintptr_t) b->list.prev;
 }
 
-/* Reverse the nodes of the list k at a time */
-void q_reverseK(struct list_head *head, int k)
+static inline void ring_swap(element_t **a, element_t **b)
 {
-    // https://leetcode.com/problems/reverse-nodes-in-k-group/
-    if (!head || list_empty(head) || list_is_singular(head) || k == 1)
-        return;
-    struct list_head *pos = head->next, *safe, *first, *first_prev;
-    int num = q_size(head);
-    for (int i = 0; i < num / k; i++) {
-        struct list_head **first_next = NULL;
-        int m = 0;
-        for (safe = pos->next; m < k; pos = safe, safe = pos->next, m++) {
-            struct list_head *next = pos->next;
-            struct list_head *prev = pos->prev;
-            if (m == 0) {
-                first = pos;
-                first_prev = prev;
-                first_next = &pos->next;
-                pos->prev = next;
-                continue;
-            }
-            if (0 < m && m < k - 1) {
-                pos->prev = next;
-                pos->next = prev;
-                continue;
-            }
-            if (m == k - 1) {
-                pos->next = prev;
-                pos->prev = first_prev;
-                *first_next = next;
-                first_prev->next = pos;
-                next->prev = first;
-                pos = next;
-                break;
-            }
-        }
+    element_t *tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static void ring_sift(element_t **v, size_t i, size_t n, bool descend)
+{
+    element_t *e = v[i];
+    for (size_t c; (c = 2 * i + 1) < n; i = c) {
+        if (c + 1 < n && ring_less(v[c], v[c + 1], descend))
+            c++;
+        if (!ring_less(e, v[c], descend))
+            break;
+        v[i] = v[c];
     }
+    v[i] = e;
 }
 
+static void ring_heapsort(element_t **v, size_t n, bool descend)
+{
+    for (size_t i = n / 2; i-- > 0;)
+        ring_sift(v, i, n, descend);
+    while (n > 1) {
+        ring_swap(&v[0], &v[--n]);
+        ring_sift(v, 0, n, descend);
+    }
+}
 
-struct list_head *merge(struct list_head *l1,
-                        struct list_head *l2,
-                        bool descend)
+static void ring_introsort(element_t **v,
+                           size_t n,
+                           unsigned depth,
+                           bool descend)
 {
-    struct list_head tmp;
-    INIT_LIST_HEAD(&tmp);
-    struct list_head *tail = &tmp;
-    if (!descend) {
-        while (l1 && l2) {
-            const element_t *node1 = list_entry(l1, element_t, list);
-            const element_t *node2 = list_entry(l2, element_t, list);
-            if (strcmp(node1->value, node2->value) <= 0) {
-                tail->next = l1;
-                l1->prev = tail;
-                tail = tail->next;
-                l1 = l1->next;
-            } else {
-                tail->next = l2;
-                l2->prev = tail;
-                tail = tail->next;
-                l2 = l2->next;
-            }
+    while (n > RING_INSERTION) {
+        if (!depth--) {
+            ring_heapsort(v, n, descend);
+            return;
         }
-    } else {
-        while (l1 && l2) {
-            const element_t *node1 = list_entry(l1, element_t, list);
-            const element_t *node2 = list_entry(l2, element_t, list);
-            if (strcmp(node1->value, node2->value) >= 0) {
-                tail->next = l1;
-                l1->prev = tail;
-                tail = tail->next;
-                l1 = l1->next;
-            } else {
-                l2->prev = tail;
-                tail->next = l2;
-                tail = tail->next;
-                l2 = l2->next;
-            }
+
+        /* Order v[0], v[m] and v[n - 1]; the outer two then bound the scans */
+        size_t m = n / 2;
+        if (ring_less(v[m], v[0], descend))
+            ring_swap(&v[0], &v[m]);
+        if (ring_less(v[n - 1], v[m], descend)) {
+            ring_swap(&v[m], &v[n - 1]);
+            if (ring_less(v[m], v[0], descend))
+                ring_swap(&v[0], &v[m]);
+        }
+        const element_t *pivot = v[m];
+        size_t i = 0, j = n - 1;
+        for (;;) {
+            while (ring_less(v[++i], pivot, descend))
+                ;
+            while (ring_less(pivot, v[--j], descend))
+                ;
+            if (i >= j)
+                break;
+            ring_swap(&v[i], &v[j]);
+        }
+
+        /* Recurse into the smaller side, loop on the larger */
+        size_t left = j + 1;
+        if (left < n - left) {
+            ring_introsort(v, left, depth, descend);
+            v += left;
+            n -= left;
+        } else {
+            ring_introsort(v + left, n - left, depth, descend);
+            n = left;
         }
     }
-    if (l1) {
-        tail->next = l1;
-        l1->prev = tail;
-    }
-    if (l2) {
-        tail->next = l2;
-        l2->prev = tail;
+
+    for (size_t i = 1; i < n; i++) {
+        element_t *e = v[i];
+        size_t j = i;
+        for (; j > 0 && ring_less(e, v[j - 1], descend); j--)
+            v[j] = v[j - 1];
+        v[j] = e;
     }
-    return tmp.next;
 }
-struct list_head *mergeSortList(struct list_head *node, bool descend)
+
+static bool ix_sort(queue_t *q, bool descend)
 {
-    if (!node || !node->next)
-        return node;
-    struct list_head *fast = node->next;
-    struct list_head *slow = node;
-    // split list
-    while (fast && fast->next) {
-        slow = slow->next;
-        fast = fast->next->next;
-    }
-    fast = slow->next;
-    slow->next = NULL;
-    if (fast) {
-        fast->prev = NULL;
+    if (!q->rvalid)
+        return false;
+
+    /* Rotate the elements to the front so that they can be sorted as one */
+    if (q->rhead) {
+        element_t **v = q->ring;
+        for (unsigned i = 0, j = q->rhead - 1; i < j; i++, j--)
+            ring_swap(&v[i], &v[j]);
+        for (unsigned i = q->rhead, j = q->rcap - 1; i < j; i++, j--)
+            ring_swap(&v[i], &v[j]);
+        for (unsigned i = 0, j = q->rcap - 1; i < j; i++, j--)
+            ring_swap(&v[i], &v[j]);
+        q->rhead = 0;
     }
 
-    // sort each list
-    struct list_head *l1 = mergeSortList(node, descend);
-    struct list_head *l2 = mergeSortList(fast, descend);
-    return merge(l1, l2, descend);
+    size_t n = q->size;
+    unsigned depth = 0;
+    for (size_t i = 0; i < n; i++)
+        q->ring[i]->list.prev = (struct list_head *) (uintptr_t) i;
+    for (size_t m = n; m > 1; m >>= 1)
+        depth += 2;
+    ring_introsort(q->ring, n, depth, descend);
+    ring_relink(q);
+    return true;
+}
+#else
+static inline bool ix_sort(queue_t *q, bool descend)
+{
+    return false;
 }
+#endif
+
 /* Sort elements of queue in ascending/descending order */
 void q_sort(struct list_head *head, bool descend)
 {
     if (!head || list_empty(head) || list_is_singular(head))
         return;
-    struct list_head *first_node = head->next;
-    struct list_head *last_node = head->prev;
-    first_node->prev = NULL;
-    last_node->next = NULL;
-    struct list_head *merge_pos = mergeSortList(first_node, descend);
-    if (!merge_pos) {
-        INIT_LIST_HEAD(head);
+    /* Sorting the nodes the other way round leaves equal elements in their
+     * original order when read backwards, so a reversed queue stays reversed.
+     */
+    queue_t *q = queue_of(head);
+    descend ^= q->reversed;
+    unsigned want = descend ? Q_ORDER_DESCEND : Q_ORDER_ASCEND;
+    /* A stable sort leaves ordered nodes as they are */
+    if (q->order & want)
         return;
+
+    if (!ix_sort(q, descend)) {
+        unsigned t = q_size(head) / PARALLEL_GRAIN;
+        if (t > pool.workers + 1)
+            t = pool.workers + 1;
+        if (t < 2) {
+            sort_list(head, descend);
+        } else {
+            /* A timeout has to wait until the list is whole again */
+            sigset_t alarm, old;
+            sigemptyset(&alarm);
+            sigaddset(&alarm, SIGALRM);
+            pthread_sigmask(SIG_BLOCK, &alarm, &old);
+            sort_parallel(head, t, descend);
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+        }
+        ix_rebuild(q);
     }
-    head->next = merge_pos;
-    merge_pos->prev = head;
-    while (merge_pos->next) {
-        merge_pos = merge_pos->next;
-    }
-    merge_pos->next = head;
-    head->prev = merge_pos;
+    q->order = want | (q->order & Q_ORDER_STRICT);
 }
 
 /* Remove every node which has a node with a strictly less value anywhere to
@@ -336,19 +2618,27 @@ int q_ascend(struct list_head *head)
         return 0;
     if (list_is_singular(head))
         return 1;
+    /* Nothing to remove from a queue which is already ascending */
+    if (q_order(head) & Q_ORDER_ASCEND)
+        return q_size(head);
+    queue_settle(queue_of(head));
     struct list_head *pos, *safe;
     element_t *node = list_entry(head->prev, element_t, list);
-    const char *mini_value = node->value;
+    const element_t *mini = node;
     for (pos = head->prev, safe = pos->prev; pos != head;
          pos = safe, safe = pos->prev) {
         node = list_entry(pos, element_t, list);
-        if (strcmp(node->value, mini_value) > 0) {
+        if (element_cmp(node, mini) > 0) {
             list_del(pos);
+            queue_of(head)->size--;
             q_release_element(node);
         } else {
-            mini_value = node->value;
+            mini = node;
         }
     }
+    queue_of(head)->order = Q_ORDER_ASCEND;
+    order_unlinked(queue_of(head));
+    ix_rebuild(queue_of(head));
     return q_size(head);
 }
 
@@ -361,22 +2651,69 @@ int q_descend(struct list_head *head)
         return 0;
     if (list_is_singular(head))
         return 1;
+    /* Nothing to remove from a queue which is already descending */
+    if (q_order(head) & Q_ORDER_DESCEND)
+        return q_size(head);
+    queue_settle(queue_of(head));
     struct list_head *pos, *safe;
     element_t *node = list_entry(head->prev, element_t, list);
-    const char *max_value = node->value;
+    const element_t *max = node;
     for (pos = head->prev, safe = pos->prev; pos != head;
          pos = safe, safe = pos->prev) {
         node = list_entry(pos, element_t, list);
-        if (strcmp(node->value, max_value) < 0) {
+        if (element_cmp(node, max) < 0) {
             list_del(pos);
+            queue_of(head)->size--;
             q_release_element(node);
         } else {
-            max_value = node->value;
+            max = node;
         }
     }
+    queue_of(head)->order = Q_ORDER_DESCEND;
+    order_unlinked(queue_of(head));
+    ix_rebuild(queue_of(head));
     return q_size(head);
 }
 
+/* Fisher-Yates shuffle. The nodes are gathered into an array first, so that
+ * every swap is O(1) and the whole shuffle is linear, then relinked in their
+ * new order. The queue is left untouched if the array cannot be allocated.
+ */
+bool q_shuffle(struct list_head *head)
+{
+    if (!head || list_empty(head) || list_is_singular(head))
+        return true;
+
+    size_t n = q_size(head);
+    struct list_head **nodes = malloc(n * sizeof(*nodes));
+    if (!nodes)
+        return false;
+
+    struct list_head *pos, *ahead;
+    size_t i = 0;
+    list_for_each_prefetch (pos, ahead, head)
+        nodes[i++] = pos;
+
+    uintptr_t state;
+    randombytes((uint8_t *) &state, sizeof(state));
+    for (i = n - 1; i > 0; i--) {
+        size_t j = random_below(&state, i + 1);
+        struct list_head *tmp = nodes[i];
+        nodes[i] = nodes[j];
+        nodes[j] = tmp;
+    }
+
+    /* A uniformly random order read backwards is just as random */
+    queue_of(head)->reversed = false;
+    order_permuted(queue_of(head));
+    INIT_LIST_HEAD(head);
+    for (i = 0; i < n; i++)
+        list_add_tail(nodes[i], head);
+    free(nodes);
+    ix_rebuild(queue_of(head));
+    return true;
+}
+
 #define __LIST_HAVE_TYPEOF
 /* Merge all the queues into one sorted queue, which is in ascending/descending
  * order */
@@ -387,15 +2724,36 @@ int q_merge(struct list_head *head, bool descend)
         return 0;
     queue_contex_t *atx = NULL,
                    *first = list_first_entry(head, queue_contex_t, chain);
+    struct tournament t = {.k = 0};
+
+    /* Queues are meant to arrive sorted; any not known to be is sorted first */
+    q_sort(first->q, descend);
+    queue_settle(queue_of(first->q));
+    tournament_add(&t, first->q);
     list_for_each_entry (atx, head, chain) {
         if (atx == first)
             continue;
         if (atx && atx->q) {
-            list_splice_tail_init(atx->q, first->q);
-            first->size += atx->size;
+            queue_t *dst = queue_of(first->q), *src = queue_of(atx->q);
+            if (t.k == MERGE_WAYS) {
+                tournament_merge(&t, first->q, descend);
+                tournament_add(&t, first->q);
+            }
+            q_sort(atx->q, descend);
+            queue_settle(src);
+            tournament_add(&t, atx->q);
+            ix_merge_into(dst, src);
+            slab_merge(&dst->slab, &src->slab);
+            dst->size += src->size;
+            src->size = 0;
+            src->order = Q_ORDER_ANY;
+            first->size = dst->size;
             atx->size = 0;
         }
     }
-    q_sort(first->q, descend);
-    return first->size;
+    tournament_merge(&t, first->q, descend);
+    queue_of(first->q)->order = descend ? Q_ORDER_DESCEND : Q_ORDER_ASCEND;
+    order_unlinked(queue_of(first->q));
+    ix_rebuild(queue_of(first->q));
+    return q_size(first->q);
 }
@@ -9,6 +9,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "harness.h"
 #include "list.h"
@@ -17,14 +18,50 @@
  * element_t - Linked list element
  * @value: pointer to array holding string
  * @list: node of a doubly-linked list
- *
- * @value needs to be explicitly allocated and freed
+ * @chunk: slab chunk the element was carved from, NULL if allocated on its own
+ * @key: first ELEMENT_KEY_BYTES bytes of the string, big-endian, zero padded
+ * @data: inline storage for the string, allocated together with the element
+ *
+ * Elements created by q_insert_head() and q_insert_tail() carry their string
+ * in @data and point @value at it, so that one allocation holds both the node
+ * and its payload. They live in slab chunks owned by the queue, which lets
+ * q_free() release the whole queue a chunk at a time. An element whose @chunk
+ * is NULL still has to be allocated and freed explicitly. Elements created
+ * while q_intern is set have no @data: their @value points at a copy of the
+ * string shared with every other element holding the same string.
+ *
+ * @key is filled in on insertion. Comparing keys as unsigned integers
+ * orders elements like strcmp() does, so most comparisons are settled without
+ * touching the strings; only elements whose keys are equal need a look past
+ * their first ELEMENT_KEY_BYTES bytes.
  */
+struct slab_chunk;
+
+#define ELEMENT_KEY_BYTES 8
+
 typedef struct {
     char *value;
     struct list_head list;
+    struct slab_chunk *chunk;
+    uint64_t key;
+    char data[];
 } element_t;
 
+/* Whether new elements share interned strings, 0 by default. Each distinct
+ * string is then stored once, with a reference count, and two such elements
+ * hold equal strings exactly when their value pointers are equal.
+ */
+extern int q_intern;
+
+/* Key of the string s of length len, as stored in element_t.key */
+static inline uint64_t element_key(const char *s, size_t len)
+{
+    uint64_t key = 0;
+    for (size_t i = 0; i < ELEMENT_KEY_BYTES; i++)
+        key = key << 8 | (i < len ? (unsigned char) s[i] : 0);
+    return key;
+}
+
 /**
  * queue_contex_t - The context managing a chain of queues
  * @q: pointer to the head of the queue
@@ -78,6 +115,34 @@ bool q_insert_head(struct list_head *head, char *s);
  */
 bool q_insert_tail(struct list_head *head, char *s);
 
+/**
+ * q_insert_head_bulk() - Insert several elements in the head
+ * @head: header of queue
+ * @s: array of the strings to be inserted
+ * @n: number of strings in @s
+ *
+ * Leaves the queue as n calls to q_insert_head() with s[0] to s[n - 1] would,
+ * so s[n - 1] ends up first. The elements are built as a chain and linked into
+ * the queue in one splice. Either all strings are inserted or, if anything
+ * cannot be allocated, none of them.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool q_insert_head_bulk(struct list_head *head, char **s, int n);
+
+/**
+ * q_insert_tail_bulk() - Insert several elements at the tail
+ * @head: header of queue
+ * @s: array of the strings to be inserted
+ * @n: number of strings in @s
+ *
+ * Like q_insert_head_bulk(), for n calls to q_insert_tail(): s[n - 1] ends up
+ * last.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool q_insert_tail_bulk(struct list_head *head, char **s, int n);
+
 /**
  * q_remove_head() - Remove the element from head of queue
  * @head: header of queue
@@ -89,7 +154,9 @@ bool q_insert_tail(struct list_head *head, char *s);
  *
  * NOTE: "remove" is different from "delete"
  * The space used by the list element and the string should not be freed.
- * The only thing "remove" need to do is unlink it.
+ * The only thing "remove" need to do is unlink it. The storage still belongs
+ * to the queue, so the element has to be given back with q_release_element()
+ * before the queue itself is freed.
  *
  * Reference:
  * https://english.stackexchange.com/questions/52508/difference-between-delete-and-remove
@@ -108,26 +175,176 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize);
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
 
+/**
+ * q_remove_head_len() - Remove the element from head of queue, telling the
+ *                       length of its string
+ * @head: header of queue
+ * @sp: buffer the string is copied to, or NULL to copy nothing
+ * @bufsize: size of @sp
+ * @len: where to store the length of the removed string, may be NULL
+ *
+ * Like q_remove_head(), but *len is set to the full length of the string, as
+ * strlen() would give it, even if it was cut short to fit @sp. Only that many
+ * bytes plus the terminator are written to @sp, never the rest of it. A caller
+ * that passes a NULL @sp borrows the string instead: the returned element's
+ * value stays readable until it is given to q_release_element().
+ *
+ * Return: the pointer to element, %NULL if queue is NULL or empty.
+ */
+element_t *q_remove_head_len(struct list_head *head,
+                             char *sp,
+                             size_t bufsize,
+                             size_t *len);
+
+/**
+ * q_remove_tail_len() - Remove the element from tail of queue, telling the
+ *                       length of its string
+ * @head: header of queue
+ * @sp: buffer the string is copied to, or NULL to copy nothing
+ * @bufsize: size of @sp
+ * @len: where to store the length of the removed string, may be NULL
+ *
+ * Return: the pointer to element, %NULL if queue is NULL or empty.
+ */
+element_t *q_remove_tail_len(struct list_head *head,
+                             char *sp,
+                             size_t bufsize,
+                             size_t *len);
+
+/**
+ * q_remove_head_n() - Remove several elements from head of queue
+ * @head: header of queue
+ * @n: number of elements to remove
+ * @list: list head the removed elements are moved to, in queue order
+ *
+ * @list is initialized first and need not be. As with q_remove_head(), the
+ * elements are only unlinked; each one has to be given back with
+ * q_release_element().
+ *
+ * Return: the number of elements removed, less than n if the queue runs out
+ */
+int q_remove_head_n(struct list_head *head, int n, struct list_head *list);
+
 /**
  * q_release_element() - Release the element
  * @e: element would be released
  *
- * This function is intended for internal use only.
+ * Elements carved from a queue slab go back to that slab and are reused by
+ * later insertions. This function is intended for internal use only.
  */
-static inline void q_release_element(element_t *e)
-{
-    test_free(e->value);
-    test_free(e);
-}
+void q_release_element(element_t *e);
 
 /**
  * q_size() - Get the size of the queue
  * @head: header of queue
  *
+ * The length is kept up to date by the queue header itself, so this takes
+ * constant time.
+ *
  * Return: the number of elements in queue, zero if queue is NULL or empty
  */
 int q_size(struct list_head *head);
 
+/**
+ * q_reversed() - Tell whether queue is stored back to front
+ * @head: header of queue
+ *
+ * q_reverse() does not touch the nodes; it marks the queue as reversed, and
+ * from then on the first element is head->prev and the next one is reached
+ * through prev. Operations that need the nodes in order put them back first.
+ * Code walking a queue by itself should go through q_first() and q_next(),
+ * or q_for_each_entry(), instead of following next pointers.
+ *
+ * Return: true if queue reads from head->prev to head->next
+ */
+bool q_reversed(struct list_head *head);
+
+/* Orders reported by q_order() */
+enum {
+    Q_ORDER_ASCEND = 1,  /* no element is greater than the next one */
+    Q_ORDER_DESCEND = 2, /* no element is less than the next one */
+    Q_ORDER_STRICT = 4,  /* together with either: no two elements are equal */
+};
+
+/**
+ * q_order() - Tell which orders queue is known to be in
+ * @head: header of queue
+ *
+ * Every queue carries the orders it is known to be in, which insertions and
+ * removals keep up to date at the cost of one comparison per insertion.
+ * q_sort() returns at once if the queue is already in the requested order,
+ * q_delete_dup(), q_ascend() and q_descend() do when they would not remove
+ * anything, and q_merge() only sorts the queues not known to be sorted. A
+ * queue with less than two elements is in every order; one that cannot be
+ * vouched for reports none, even if it happens to be sorted.
+ *
+ * Return: a combination of Q_ORDER_* flags, zero if queue is NULL
+ */
+int q_order(struct list_head *head);
+
+/* First node of queue head, head itself if the queue is empty */
+#define q_first(head) (q_reversed(head) ? (head)->prev : (head)->next)
+
+/* Last node of queue head, head itself if the queue is empty */
+#define q_last(head) (q_reversed(head) ? (head)->next : (head)->prev)
+
+/* Node following node in queue head, head itself after the last one */
+#define q_next(head, node) (q_reversed(head) ? (node)->prev : (node)->next)
+
+/**
+ * q_for_each_entry() - Iterate over the elements of a queue in its order
+ * @entry: element_t pointer used as iterator
+ * @head: header of queue
+ *
+ * Like list_for_each_entry(), but reads a reversed queue backwards. The
+ * current element must not be removed.
+ */
+#define q_for_each_entry(entry, head)                        \
+    for (entry = list_entry(q_first(head), element_t, list); \
+         &entry->list != (head);                             \
+         entry = list_entry(q_next(head, &entry->list), element_t, list))
+
+/* Move a prefetch cursor one node further in queue head, and prefetch the
+ * string of the node it leaves as well as the node it reaches. The cursor
+ * stops at head.
+ */
+static inline struct list_head *q_prefetch_next(struct list_head *head,
+                                                struct list_head *ahead)
+{
+    if (ahead == head)
+        return ahead;
+    list_prefetch(list_entry(ahead, element_t, list)->value);
+    ahead = q_next(head, ahead);
+    list_prefetch(ahead);
+    return ahead;
+}
+
+/* Start a prefetch cursor LIST_PREFETCH_HOPS nodes after node in queue head */
+static inline struct list_head *q_prefetch_ahead(struct list_head *head,
+                                                 struct list_head *node)
+{
+    for (int i = 0; i < LIST_PREFETCH_HOPS; i++)
+        node = q_prefetch_next(head, node);
+    return node;
+}
+
+/**
+ * q_for_each_entry_prefetch() - Iterate over a queue, prefetching ahead
+ * @entry: element_t pointer used as iterator
+ * @ahead: list_head pointer used as prefetch cursor
+ * @head: header of queue
+ *
+ * Like q_for_each_entry(), but prefetches the nodes and strings of the
+ * elements a few places ahead, as list_for_each_prefetch() does. Worth it on
+ * long queues whose elements are spread over memory, such as shuffled ones.
+ */
+#define q_for_each_entry_prefetch(entry, ahead, head)                     \
+    for (entry = list_entry(q_first(head), element_t, list),              \
+        ahead = q_prefetch_ahead(head, &entry->list);                     \
+         &entry->list != (head);                                          \
+         entry = list_entry(q_next(head, &entry->list), element_t, list), \
+        ahead = q_prefetch_next(head, ahead))
+
 /**
  * q_delete_mid() - Delete the middle node in queue
  * @head: header of queue
@@ -168,7 +385,7 @@ void q_swap(struct list_head *head);
  * q_reverse() - Reverse elements in queue
  * @head: header of queue
  *
- * No effect if queue is NULL or empty.
+ * No effect if queue is NULL or empty. Takes constant time, see q_reversed().
  * This function should not allocate or free any list elements
  * (e.g., by calling q_insert_head, q_insert_tail, or q_remove_head).
  * It should rearrange the existing ones.
@@ -196,10 +413,51 @@ void q_reverseK(struct list_head *head, int k);
  * @descend: whether or not to sort in descending order
  *
  * No effect if queue is NULL or empty. If there has only one element, do
- * nothing.
+ * nothing. The sort is stable: equal strings keep their relative order.
  */
 void q_sort(struct list_head *head, bool descend);
 
+/* Sorting engines selectable through q_sort_engine */
+enum {
+    Q_SORT_BOTTOM_UP, /* iterative merge sort in the style of list_sort() */
+    Q_SORT_TOP_DOWN,  /* recursive merge sort, kept as a reference */
+    Q_SORT_ADAPTIVE,  /* natural-run merge sort with galloping, like Timsort */
+    Q_SORT_RADIX,     /* most significant digit radix sort on string bytes */
+};
+
+/* Engine used by q_sort(), Q_SORT_ADAPTIVE by default */
+extern int q_sort_engine;
+
+#define Q_SORT_MAX_THREADS 64
+
+/* Threads q_sort() may use on large queues, 1 by default */
+extern int q_sort_threads;
+
+/**
+ * q_sort_start_threads() - Start the worker threads used by q_sort()
+ *
+ * Stops the current workers and starts q_sort_threads - 1 new ones, which
+ * sleep until a queue long enough to be worth splitting is sorted. q_sort()
+ * gives each of them a share of the list, so its result and stability do not
+ * depend on the thread count. q_sort_threads is clamped to
+ * [1, Q_SORT_MAX_THREADS] and lowered to the number of threads that could
+ * actually be started.
+ *
+ * Return: false if fewer threads than requested could be started
+ */
+bool q_sort_start_threads(void);
+
+/**
+ * q_shuffle() - Put the elements of queue in a uniformly random order
+ * @head: header of queue
+ *
+ * Fisher-Yates shuffle in linear time, using a temporary array of nodes.
+ *
+ * Return: false if the array could not be allocated, in which case the queue
+ * is left as it was
+ */
+bool q_shuffle(struct list_head *head);
+
 /**
  * q_ascend() - Remove every node which has a node with a strictly less
  * value anywhere to the right side of it.
@@ -49,4 +49,22 @@ static inline uintptr_t random_shuffle(uintptr_t x)
     return x;
 }
 
+/* Uniform draw from [0, bound) for bound > 0, stepping a splitmix generator
+ * kept in state. Lemire's multiply-shift maps a random word onto the range;
+ * the few low products that would favour some results over others are
+ * rejected and redrawn, which needs a division only when one is close.
+ */
+static inline uint32_t random_below(uintptr_t *state, uint32_t bound)
+{
+    uint64_t m;
+    uint32_t low;
+
+    do {
+        *state += (uintptr_t) 0x9e3779b97f4a7c15ULL;
+        m = (uint64_t) (uint32_t) random_shuffle(*state) * bound;
+        low = (uint32_t) m;
+    } while (low < bound && low < (uint32_t) -bound % bound);
+    return m >> 32;
+}
+
 #endif
@@ -0,0 +1,141 @@
+/* String comparison a vector at a time, see simd_strcmp.h */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(SIMD_STRCMP_OFF)
+#include <immintrin.h>
+#define SIMD_STRCMP_X86 1
+#endif
+
+#include "simd_strcmp.h"
+
+/* Smallest page size of the targets we run on. A load that starts at a
+ * readable byte and stays within its page cannot fault, whatever lies past
+ * the end of the string.
+ */
+#define PAGE_SIZE 4096
+
+/* Might reading n bytes from a or b run into the next page? Or-ing the
+ * offsets errs on the side of yes, which only costs a bytewise step.
+ */
+static inline bool crosses_page(const char *a, const char *b, size_t n)
+{
+    return (((uintptr_t) a | (uintptr_t) b) & (PAGE_SIZE - 1)) > PAGE_SIZE - n;
+}
+
+static int strcmp_scalar(const char *a, const char *b)
+{
+    const unsigned char *x = (const unsigned char *) a;
+    const unsigned char *y = (const unsigned char *) b;
+
+    while (*x && *x == *y) {
+        x++;
+        y++;
+    }
+    return *x - *y;
+}
+
+#ifdef SIMD_STRCMP_X86
+/* Index of the first of n bytes where a and b differ or a ends, n if there
+ * is none, looking at one byte at a time
+ */
+static inline size_t stop_bytes(const char *a, const char *b, size_t n)
+{
+    size_t i = 0;
+    while (i < n && a[i] && a[i] == b[i])
+        i++;
+    return i;
+}
+
+/* Random strings mostly differ at their first byte, which is cheaper to
+ * settle without setting up any vectors.
+ */
+#define FIRST_BYTE(a, b)                                        \
+    do {                                                        \
+        if (*(a) != *(b) || !*(a))                              \
+            return (unsigned char) *(a) - (unsigned char) *(b); \
+    } while (0)
+
+/* Each step finds the first byte where the strings differ or a ends: equal
+ * bytes are kept by the minimum with the equality mask, everything else turns
+ * into zero, and a comparison with zero plus movemask and ctz locates it.
+ *
+ * The loads read past the null byte on purpose, which AddressSanitizer would
+ * report, so it is kept out of these functions.
+ */
+#define VECTOR_KERNEL(isa) __attribute__((target(isa), no_sanitize_address))
+
+VECTOR_KERNEL("sse2") static int strcmp_sse2(const char *a, const char *b)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i;
+
+    FIRST_BYTE(a, b);
+    for (;; a += 16, b += 16) {
+        if (crosses_page(a, b, 16)) {
+            if ((i = stop_bytes(a, b, 16)) < 16)
+                break;
+            continue;
+        }
+        __m128i x = _mm_loadu_si128((const __m128i *) a);
+        __m128i y = _mm_loadu_si128((const __m128i *) b);
+        __m128i m = _mm_min_epu8(x, _mm_cmpeq_epi8(x, y));
+        unsigned stop = _mm_movemask_epi8(_mm_cmpeq_epi8(m, zero));
+        if (stop) {
+            i = __builtin_ctz(stop);
+            break;
+        }
+    }
+    return (unsigned char) a[i] - (unsigned char) b[i];
+}
+
+VECTOR_KERNEL("avx2") static int strcmp_avx2(const char *a, const char *b)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i;
+
+    FIRST_BYTE(a, b);
+    for (;; a += 32, b += 32) {
+        if (crosses_page(a, b, 32)) {
+            if ((i = stop_bytes(a, b, 32)) < 32)
+                break;
+            continue;
+        }
+        __m256i x = _mm256_loadu_si256((const __m256i *) a);
+        __m256i y = _mm256_loadu_si256((const __m256i *) b);
+        __m256i m = _mm256_min_epu8(x, _mm256_cmpeq_epi8(x, y));
+        unsigned stop = _mm256_movemask_epi8(_mm256_cmpeq_epi8(m, zero));
+        if (stop) {
+            i = __builtin_ctz(stop);
+            break;
+        }
+    }
+    return (unsigned char) a[i] - (unsigned char) b[i];
+}
+#endif
+
+/* Room for every implementation plus the terminator */
+static struct strcmp_impl impls[4] = {{"scalar", strcmp_scalar}};
+
+strcmp_fn_t simd_strcmp = strcmp_scalar;
+
+__attribute__((constructor)) static void simd_strcmp_init(void)
+{
+    size_t n = 1;
+
+#ifdef SIMD_STRCMP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        impls[n++] = (struct strcmp_impl){"sse2", strcmp_sse2};
+    if (__builtin_cpu_supports("avx2"))
+        impls[n++] = (struct strcmp_impl){"avx2", strcmp_avx2};
+#endif
+    simd_strcmp = impls[n - 1].cmp;
+}
+
+const struct strcmp_impl *strcmp_impls(void)
+{
+    return impls;
+}
@@ -0,0 +1,37 @@
+#ifndef LAB0_SIMD_STRCMP_H
+#define LAB0_SIMD_STRCMP_H
+
+/* String comparison a vector at a time.
+ *
+ * simd_strcmp() orders strings like strcmp() does, comparing 32 bytes per step
+ * with AVX2, 16 with SSE2, or one at a time where neither is available. The
+ * implementation is picked once at startup from what the CPU supports.
+ * Vector loads may read past the terminating null byte, but never into the
+ * next page, so they cannot fault.
+ */
+
+/* Signature shared by every implementation, and by strcmp() itself */
+typedef int (*strcmp_fn_t)(const char *a, const char *b);
+
+/* Comparison used by the queue, set up before main() runs */
+extern strcmp_fn_t simd_strcmp;
+
+/**
+ * struct strcmp_impl - One implementation of simd_strcmp()
+ * @name: short name, such as "avx2"
+ * @cmp: the comparison function
+ */
+struct strcmp_impl {
+    const char *name;
+    strcmp_fn_t cmp;
+};
+
+/**
+ * strcmp_impls() - List the implementations this CPU can run
+ *
+ * Return: array ending with an entry whose name is NULL, fastest last; the
+ * last one is what simd_strcmp() points at
+ */
+const struct strcmp_impl *strcmp_impls(void);
+
+#endif /* LAB0_SIMD_STRCMP_H */
@@ -259,7 +259,7 @@ int web_eventmux(char *buf)
         char *p = web_recv(web_connfd, &clientaddr);
         char *buffer = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n";
         web_send(web_connfd, buffer);
-        strncpy(buf, p, strlen(p) + 1);
+        memcpy(buf, p, strlen(p) + 1);
         free(p);
         close(web_connfd);
         return strlen(buf);